@@ -303,6 +303,25 @@
 #define cimg_pragma_openmp(p)
 #endif
 
+// SIMD kernels (SSE2, AVX2 or AVX-512, selected at runtime by CPU feature)
+// are used to blend images with opacity in draw_image().
+#if !defined(cimg_use_simd)
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define cimg_use_simd 1
+#else
+#define cimg_use_simd 0
+#endif
+#endif
+#if cimg_use_simd!=0
+#include <immintrin.h>
+// Keep multiplications and additions separate, so that SIMD kernels round exactly like scalar code.
+#if defined(__clang__)
+#define cimg_simd_target(isa) __attribute__((target(isa)))
+#else
+#define cimg_simd_target(isa) __attribute__((target(isa),optimize("fp-contract=off")))
+#endif
+#endif
+
 // Configure the 'abort' signal handler (does nothing by default).
 // A typical signal handler can be defined in your own source like this:
 // #define cimg_abort_test if (is_abort) throw CImgAbortException("")
@@ -5537,6 +5556,297 @@ namespace cimg_library_suffixed {
       return res?res:1U;
     }
 
+    inline unsigned int _simd_level() {
+#if cimg_use_simd!=0
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx512f")?3U:__builtin_cpu_supports("avx2")?2U:
+        __builtin_cpu_supports("sse2")?1U:0U;
+#else
+      return 0;
+#endif
+    }
+
+    //! Return level of SIMD instructions used by the blending kernels.
+    /**
+       \return \c 0 (scalar), \c 1 (SSE2), \c 2 (AVX2) or \c 3 (AVX-512).
+    **/
+    inline unsigned int simd_level() {
+      static const unsigned int level = _simd_level();
+      return level;
+    }
+
+    //! Blend a span of pixels with opacity, as \c ptrd = \c nopacity*ptrs + \c copacity*ptrd.
+    /**
+       \param ptrd Destination pixels.
+       \param ptrs Source pixels.
+       \param n Number of pixels.
+       \param nopacity Weight of the source pixels.
+       \param copacity Weight of the destination pixels.
+       \note Specialized versions for \c float and \c unsigned \c char use SIMD instructions,
+       rounding as this scalar loop does when compiled without floating-point contraction.
+    **/
+    template<typename T, typename t>
+    inline void blend(T *ptrd, const t *ptrs, const cimg_ulong n, const float nopacity, const float copacity) {
+      for (cimg_ulong i = 0; i<n; ++i) { *ptrd = (T)(nopacity*(*(ptrs++)) + *ptrd*copacity); ++ptrd; }
+    }
+
+#if cimg_use_simd!=0
+    cimg_simd_target("sse2")
+    inline cimg_ulong _blend_sse2(float *const ptrd, const float *const ptrs, const cimg_ulong n,
+                                  const float nopacity, const float copacity) {
+      const __m128 no = _mm_set1_ps(nopacity), co = _mm_set1_ps(copacity);
+      cimg_ulong i = 0;
+      for ( ; i + 4<=n; i+=4)
+        _mm_storeu_ps(ptrd + i,_mm_add_ps(_mm_mul_ps(no,_mm_loadu_ps(ptrs + i)),
+                                          _mm_mul_ps(_mm_loadu_ps(ptrd + i),co)));
+      return i;
+    }
+
+    cimg_simd_target("avx2")
+    inline cimg_ulong _blend_avx2(float *const ptrd, const float *const ptrs, const cimg_ulong n,
+                                  const float nopacity, const float copacity) {
+      const __m256 no = _mm256_set1_ps(nopacity), co = _mm256_set1_ps(copacity);
+      cimg_ulong i = 0;
+      for ( ; i + 8<=n; i+=8)
+        _mm256_storeu_ps(ptrd + i,_mm256_add_ps(_mm256_mul_ps(no,_mm256_loadu_ps(ptrs + i)),
+                                                _mm256_mul_ps(_mm256_loadu_ps(ptrd + i),co)));
+      return i;
+    }
+
+    cimg_simd_target("avx512f")
+    inline cimg_ulong _blend_avx512(float *const ptrd, const float *const ptrs, const cimg_ulong n,
+                                    const float nopacity, const float copacity) {
+      const __m512 no = _mm512_set1_ps(nopacity), co = _mm512_set1_ps(copacity);
+      cimg_ulong i = 0;
+      for ( ; i + 16<=n; i+=16)
+        _mm512_storeu_ps(ptrd + i,_mm512_add_ps(_mm512_mul_ps(no,_mm512_loadu_ps(ptrs + i)),
+                                                _mm512_mul_ps(_mm512_loadu_ps(ptrd + i),co)));
+      return i;
+    }
+
+    cimg_simd_target("sse2")
+    inline cimg_ulong _blend_sse2(unsigned char *const ptrd, const unsigned char *const ptrs, const cimg_ulong n,
+                                  const float nopacity, const float copacity) {
+      const __m128 no = _mm_set1_ps(nopacity), co = _mm_set1_ps(copacity);
+      const __m128i zero = _mm_setzero_si128();
+      cimg_ulong i = 0;
+      for ( ; i + 16<=n; i+=16) {
+        const __m128i
+          s8 = _mm_loadu_si128((const __m128i*)(ptrs + i)), d8 = _mm_loadu_si128((const __m128i*)(ptrd + i)),
+          s16[2] = { _mm_unpacklo_epi8(s8,zero), _mm_unpackhi_epi8(s8,zero) },
+          d16[2] = { _mm_unpacklo_epi8(d8,zero), _mm_unpackhi_epi8(d8,zero) };
+        __m128i r32[4];
+        for (int k = 0; k<4; ++k) {
+          const __m128i
+            s32 = (k&1)?_mm_unpackhi_epi16(s16[k>>1],zero):_mm_unpacklo_epi16(s16[k>>1],zero),
+            d32 = (k&1)?_mm_unpackhi_epi16(d16[k>>1],zero):_mm_unpacklo_epi16(d16[k>>1],zero);
+          r32[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(no,_mm_cvtepi32_ps(s32)),
+                                               _mm_mul_ps(_mm_cvtepi32_ps(d32),co)));
+        }
+        _mm_storeu_si128((__m128i*)(ptrd + i),_mm_packus_epi16(_mm_packs_epi32(r32[0],r32[1]),
+                                                                _mm_packs_epi32(r32[2],r32[3])));
+      }
+      return i;
+    }
+
+    cimg_simd_target("avx2")
+    inline cimg_ulong _blend_avx2(unsigned char *const ptrd, const unsigned char *const ptrs, const cimg_ulong n,
+                                  const float nopacity, const float copacity) {
+      const __m256 no = _mm256_set1_ps(nopacity), co = _mm256_set1_ps(copacity);
+      cimg_ulong i = 0;
+      for ( ; i + 8<=n; i+=8) {
+        const __m256i
+          s32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(ptrs + i))),
+          d32 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(ptrd + i))),
+          r32 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(no,_mm256_cvtepi32_ps(s32)),
+                                                  _mm256_mul_ps(_mm256_cvtepi32_ps(d32),co)));
+        const __m128i r16 = _mm_packs_epi32(_mm256_castsi256_si128(r32),_mm256_extracti128_si256(r32,1));
+        _mm_storel_epi64((__m128i*)(ptrd + i),_mm_packus_epi16(r16,r16));
+      }
+      return i;
+    }
+
+    cimg_simd_target("avx512f")
+    inline cimg_ulong _blend_avx512(unsigned char *const ptrd, const unsigned char *const ptrs, const cimg_ulong n,
+                                    const float nopacity, const float copacity) {
+      // Conversions are masked with explicit zero sources: the unmasked forms start from an
+      // undefined register, which GCC reports as maybe uninitialized.
+      const __m512 no = _mm512_set1_ps(nopacity), co = _mm512_set1_ps(copacity), fzero = _mm512_setzero_ps();
+      const __m512i zero = _mm512_setzero_si512();
+      const __m128i zero8 = _mm_setzero_si128();
+      const __mmask16 all = 0xFFFF;
+      cimg_ulong i = 0;
+      for ( ; i + 16<=n; i+=16) {
+        const __m512i
+          s32 = _mm512_mask_cvtepu8_epi32(zero,all,_mm_loadu_si128((const __m128i*)(ptrs + i))),
+          d32 = _mm512_mask_cvtepu8_epi32(zero,all,_mm_loadu_si128((const __m128i*)(ptrd + i))),
+          r32 = _mm512_mask_cvttps_epi32(zero,all,
+                                         _mm512_add_ps(_mm512_mul_ps(no,_mm512_mask_cvtepi32_ps(fzero,all,s32)),
+                                                       _mm512_mul_ps(_mm512_mask_cvtepi32_ps(fzero,all,d32),co)));
+        _mm_storeu_si128((__m128i*)(ptrd + i),
+                         _mm512_mask_cvtusepi32_epi8(zero8,all,_mm512_mask_max_epi32(zero,all,r32,zero)));
+      }
+      return i;
+    }
+
+    template<typename T>
+    inline void _blend_simd(T *const ptrd, const T *const ptrs, const cimg_ulong n,
+                            const float nopacity, const float copacity) {
+      const unsigned int level = simd_level();
+      cimg_ulong i = 0;
+      switch (level) {
+      case 3 : i = _blend_avx512(ptrd,ptrs,n,nopacity,copacity); break;
+      case 2 : i = _blend_avx2(ptrd,ptrs,n,nopacity,copacity); break;
+      case 1 : i = _blend_sse2(ptrd,ptrs,n,nopacity,copacity); break;
+      default : blend(ptrd,ptrs,n,nopacity,copacity); return;
+      }
+      if (i==n) return;
+
+      // Blend remaining pixels with the same kernel, so results do not depend on the span length.
+      T tail_d[16] = { 0 }, tail_s[16] = { 0 };
+      std::memcpy(tail_d,ptrd + i,(n - i)*sizeof(T));
+      std::memcpy(tail_s,ptrs + i,(n - i)*sizeof(T));
+      switch (level) {
+      case 3 : _blend_avx512(tail_d,tail_s,16,nopacity,copacity); break;
+      case 2 : _blend_avx2(tail_d,tail_s,16,nopacity,copacity); break;
+      default : _blend_sse2(tail_d,tail_s,16,nopacity,copacity);
+      }
+      std::memcpy(ptrd + i,tail_d,(n - i)*sizeof(T));
+    }
+
+    inline void blend(float *const ptrd, const float *const ptrs, const cimg_ulong n,
+                      const float nopacity, const float copacity) {
+      _blend_simd(ptrd,ptrs,n,nopacity,copacity);
+    }
+
+    inline void blend(unsigned char *const ptrd, const unsigned char *const ptrs, const cimg_ulong n,
+                      const float nopacity, const float copacity) {
+      _blend_simd(ptrd,ptrs,n,nopacity,copacity);
+    }
+#endif
+
+    //! Compute the curvature flow velocity of a row of pixels, as used by CImg<T>::smooth().
+    /**
+       \param ptrd Destination velocities.
+       \param ptrp Row above (same as \c ptrc on the first row).
+       \param ptrc Current row.
+       \param ptrn Row below (same as \c ptrc on the last row).
+       \param n Row width.
+       \return Maximum magnitude of the velocities.
+       \note Borders are replicated. The version for \c float uses SIMD instructions on the row interior,
+       with the same operations in the same order as the scalar loop, so results are identical.
+    **/
+    template<typename T, typename t>
+    inline float smooth_velocity(T *const ptrd, const t *const ptrp, const t *const ptrc, const t *const ptrn,
+                                 const int n, const int x0=0, int x1=-1) {
+      if (x1<0) x1 = n - 1;
+      float betamax = 0;
+      for (int x = x0; x<=x1; ++x) {
+        const int _p1x = x?x - 1:0, _n1x = x<n - 1?x + 1:x;
+        const float
+          Ipp = (float)ptrp[_p1x], Icp = (float)ptrp[x], Inp = (float)ptrp[_n1x],
+          Ipc = (float)ptrc[_p1x], Icc = (float)ptrc[x], Inc = (float)ptrc[_n1x],
+          Ipn = (float)ptrn[_p1x], Icn = (float)ptrn[x], Inn = (float)ptrn[_n1x],
+          ix = (Inc - Ipc)/2,
+          iy = (Icn - Icp)/2,
+          ng = (float)std::sqrt(1e-10f + ix*ix + iy*iy),
+          ixx = Inc + Ipc - 2*Icc,
+          iyy = Icn + Icp - 2*Icc,
+          ixy = 0.25f*(Inn + Ipp - Ipn - Inp),
+          iee = (ix*ix*iyy + iy*iy*ixx - 2*ix*iy*ixy)/(ng*ng),
+          beta = iee/(0.1f + ng);
+        if (beta>betamax) betamax = beta; else if (-beta>betamax) betamax = -beta;
+        ptrd[x] = (T)beta;
+      }
+      return betamax;
+    }
+
+#if cimg_use_simd!=0
+    // Interior pixels [1,n-1) of a row, 8 at a time. Return the first pixel left.
+    cimg_simd_target("avx2")
+    inline int _smooth_velocity_avx2(float *const ptrd, const float *const ptrp, const float *const ptrc,
+                                     const float *const ptrn, const int n, float &betamax) {
+      const __m256
+        half = _mm256_set1_ps(0.5f), quarter = _mm256_set1_ps(0.25f), two = _mm256_set1_ps(2.f),
+        eps = _mm256_set1_ps(1e-10f), tenth = _mm256_set1_ps(0.1f),
+        abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+      __m256 m = _mm256_setzero_ps();
+      int x = 1;
+      for ( ; x + 8<=n - 1; x+=8) {
+        const __m256
+          Ipp = _mm256_loadu_ps(ptrp + x - 1), Icp = _mm256_loadu_ps(ptrp + x), Inp = _mm256_loadu_ps(ptrp + x + 1),
+          Ipc = _mm256_loadu_ps(ptrc + x - 1), Icc = _mm256_loadu_ps(ptrc + x), Inc = _mm256_loadu_ps(ptrc + x + 1),
+          Ipn = _mm256_loadu_ps(ptrn + x - 1), Icn = _mm256_loadu_ps(ptrn + x), Inn = _mm256_loadu_ps(ptrn + x + 1),
+          ix = _mm256_mul_ps(_mm256_sub_ps(Inc,Ipc),half),
+          iy = _mm256_mul_ps(_mm256_sub_ps(Icn,Icp),half),
+          ix2 = _mm256_mul_ps(ix,ix), iy2 = _mm256_mul_ps(iy,iy),
+          ng = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(eps,ix2),iy2)),
+          dIcc = _mm256_mul_ps(two,Icc),
+          ixx = _mm256_sub_ps(_mm256_add_ps(Inc,Ipc),dIcc),
+          iyy = _mm256_sub_ps(_mm256_add_ps(Icn,Icp),dIcc),
+          ixy = _mm256_mul_ps(quarter,_mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(Inn,Ipp),Ipn),Inp)),
+          num = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ix2,iyy),_mm256_mul_ps(iy2,ixx)),
+                              _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(two,ix),iy),ixy)),
+          iee = _mm256_div_ps(num,_mm256_mul_ps(ng,ng)),
+          beta = _mm256_div_ps(iee,_mm256_add_ps(tenth,ng));
+        m = _mm256_max_ps(_mm256_and_ps(beta,abs_mask),m);
+        _mm256_storeu_ps(ptrd + x,beta);
+      }
+      float res[8];
+      _mm256_storeu_ps(res,m);
+      for (int k = 0; k<8; ++k) if (res[k]>betamax) betamax = res[k];
+      return x;
+    }
+
+    cimg_simd_target("avx512f")
+    inline int _smooth_velocity_avx512(float *const ptrd, const float *const ptrp, const float *const ptrc,
+                                       const float *const ptrn, const int n, float &betamax) {
+      const __m512
+        half = _mm512_set1_ps(0.5f), quarter = _mm512_set1_ps(0.25f), two = _mm512_set1_ps(2.f),
+        eps = _mm512_set1_ps(1e-10f), tenth = _mm512_set1_ps(0.1f), zero = _mm512_setzero_ps();
+      const __mmask16 all = 0xFFFF; // Masked forms avoid the undefined start registers of sqrt/max.
+      __m512 m = zero;
+      int x = 1;
+      for ( ; x + 16<=n - 1; x+=16) {
+        const __m512
+          Ipp = _mm512_loadu_ps(ptrp + x - 1), Icp = _mm512_loadu_ps(ptrp + x), Inp = _mm512_loadu_ps(ptrp + x + 1),
+          Ipc = _mm512_loadu_ps(ptrc + x - 1), Icc = _mm512_loadu_ps(ptrc + x), Inc = _mm512_loadu_ps(ptrc + x + 1),
+          Ipn = _mm512_loadu_ps(ptrn + x - 1), Icn = _mm512_loadu_ps(ptrn + x), Inn = _mm512_loadu_ps(ptrn + x + 1),
+          ix = _mm512_mul_ps(_mm512_sub_ps(Inc,Ipc),half),
+          iy = _mm512_mul_ps(_mm512_sub_ps(Icn,Icp),half),
+          ix2 = _mm512_mul_ps(ix,ix), iy2 = _mm512_mul_ps(iy,iy),
+          ng = _mm512_mask_sqrt_ps(zero,all,_mm512_add_ps(_mm512_add_ps(eps,ix2),iy2)),
+          dIcc = _mm512_mul_ps(two,Icc),
+          ixx = _mm512_sub_ps(_mm512_add_ps(Inc,Ipc),dIcc),
+          iyy = _mm512_sub_ps(_mm512_add_ps(Icn,Icp),dIcc),
+          ixy = _mm512_mul_ps(quarter,_mm512_sub_ps(_mm512_sub_ps(_mm512_add_ps(Inn,Ipp),Ipn),Inp)),
+          num = _mm512_sub_ps(_mm512_add_ps(_mm512_mul_ps(ix2,iyy),_mm512_mul_ps(iy2,ixx)),
+                              _mm512_mul_ps(_mm512_mul_ps(_mm512_mul_ps(two,ix),iy),ixy)),
+          iee = _mm512_div_ps(num,_mm512_mul_ps(ng,ng)),
+          beta = _mm512_div_ps(iee,_mm512_add_ps(tenth,ng));
+        m = _mm512_mask_max_ps(zero,all,_mm512_abs_ps(beta),m);
+        _mm512_storeu_ps(ptrd + x,beta);
+      }
+      float res[16];
+      _mm512_storeu_ps(res,m);
+      for (int k = 0; k<16; ++k) if (res[k]>betamax) betamax = res[k];
+      return x;
+    }
+
+    inline float smooth_velocity(float *const ptrd, const float *const ptrp, const float *const ptrc,
+                                 const float *const ptrn, const int n) {
+      float betamax = 0;
+      int x = 1;
+      switch (simd_level()) {
+      case 3 : x = _smooth_velocity_avx512(ptrd,ptrp,ptrc,ptrn,n,betamax); break;
+      case 2 : x = _smooth_velocity_avx2(ptrd,ptrp,ptrc,ptrn,n,betamax); break;
+      default : return smooth_velocity<float,float>(ptrd,ptrp,ptrc,ptrn,n);
+      }
+      return std::max(betamax,std::max(smooth_velocity<float,float>(ptrd,ptrp,ptrc,ptrn,n,0,0),
+                                       smooth_velocity<float,float>(ptrd,ptrp,ptrc,ptrn,n,x,n - 1)));
+    }
+#endif
+
     // Lock/unlock mutex for CImg multi-thread programming.
     inline int mutex(const unsigned int n, const int lock_mode) {
       switch (lock_mode) {
@@ -45722,7 +46032,7 @@ namespace cimg_library_suffixed {
           for (int z = 0; z<lZ; ++z) {
             for (int y = 0; y<lY; ++y) {
               if (opacity>=1) for (int x = 0; x<lX; ++x) *(ptrd++) = (T)*(ptrs++);
-              else for (int x = 0; x<lX; ++x) { *ptrd = (T)(nopacity*(*(ptrs++)) + *ptrd*copacity); ++ptrd; }
+              else { cimg::blend(ptrd,ptrs,lX,nopacity,copacity); ptrd+=lX; ptrs+=lX; }
               ptrd+=offX; ptrs+=soffX;
             }
             ptrd+=offY; ptrs+=soffY;
@@ -45753,8 +46063,6 @@ namespace cimg_library_suffixed {
         (bz?-z0*(ulongT)sprite.width()*sprite.height():0) +
         (bc?-c0*(ulongT)sprite.width()*sprite.height()*sprite.depth():0);
       const ulongT
-        offX = (ulongT)_width - lX,
-        soffX = (ulongT)sprite._width - lX,
         offY = (ulongT)_width*(_height - lY),
         soffY = (ulongT)sprite._width*(sprite._height - lY),
         offZ = (ulongT)_width*_height*(_depth - lZ),
@@ -45768,8 +46076,8 @@ namespace cimg_library_suffixed {
             if (opacity>=1)
               for (int y = 0; y<lY; ++y) { std::memcpy(ptrd,ptrs,slX); ptrd+=_width; ptrs+=sprite._width; }
             else for (int y = 0; y<lY; ++y) {
-                for (int x = 0; x<lX; ++x) { *ptrd = (T)(nopacity*(*(ptrs++)) + *ptrd*copacity); ++ptrd; }
-                ptrd+=offX; ptrs+=soffX;
+                cimg::blend(ptrd,ptrs,lX,nopacity,copacity);
+                ptrd+=_width; ptrs+=sprite._width;
               }
             ptrd+=offY; ptrs+=soffY;
           }
@@ -56148,57 +56456,144 @@ namespace cimg_library_suffixed {
     //Custom library
     /**
     	CImgList<T> smooth(CImg<T>, iter)
+    	CImg<T> smooth_iterate(CImg<T>, iter, checkpoint)
     	CImg<T> get_smooth(CImg<T>, index, iter)
     	CImgList<T> blur_gradient(CImg<T>, sigma)
     **/
 
     // Smooth image for n iterations and stored in CImgList
     /*
-		iter is the number of total iterations
+		iter is the number of total iterations, the list holds the image and its iter iterates.
+		Use smooth_iterate() when only some iterates are needed.
     */
     CImgList<T> smooth(unsigned int iter=50) {
-    	if (is_empty()) return CImgList<T>(*this);
-    	if (!cimg::type<T>::is_float()) {
-    		return CImg<Tfloat>(*this).smooth(iter);
-    	}
     	CImgList<T> list(*this);
+    	if (is_empty()) return list;
+    	CImg<T>(*this,false).smooth_iterate(iter,_smooth_insert(list));
+    	return list;
+    }
 
-    	for (unsigned int i = 0; i < iter; ++i) {
-		    // Compute PDE velocity field.
-    		
-    		CImg<T> img = list[list.size()-1];
-		    CImg_3x3(I,float);
-		    CImg<T> veloc(*this);
-		    float *ptrd = veloc.data(), betamax = 0;
-		    cimg_forC(*this,k) cimg_for3x3(img,x,y,0,k,I,float) {
-		      const float
-		        ix = (Inc - Ipc)/2,
-		        iy = (Icn - Icp)/2,
-		        ng = (float)std::sqrt(1e-10f + ix*ix + iy*iy),
-		        ixx = Inc + Ipc - 2*Icc,
-		        iyy = Icn + Icp - 2*Icc,
-		        ixy = 0.25f*(Inn + Ipp - Ipn - Inp),
-		        iee = (ix*ix*iyy + iy*iy*ixx - 2*ix*iy*ixy)/(ng*ng),
-		        beta = iee/(0.1f + ng);
-		      if (beta>betamax) betamax = beta; else if (-beta>betamax) betamax = -beta;
-		      *(ptrd++) = beta;
-		    }
-		    veloc*=40.0f/betamax;
-		    img+=veloc;
-		    img.move_to(list);
-		}
+    // [internal] Checkpoints of smooth_iterate(): append each iterate to a list, or do nothing.
+    struct _smooth_insert {
+    	CImgList<T>& list;
+    	_smooth_insert(CImgList<T>& plist):list(plist) {}
+    	void operator()(const unsigned int, const CImg<T>& img) const {
+    		list.insert(img);
+    	}
+    };
 
-		return list;
-	}
+    struct _smooth_ignore {
+    	void operator()(const unsigned int, const CImg<T>&) const {}
+    };
+
+    // Smooth image in place for iter iterations, holding two buffers whatever iter is
+    /*
+		checkpoint(i, img) is called after each iteration i = 1..iter, img being the i-th iterate.
+		The velocity of the PDE is computed into the second buffer, which then receives the next
+		iterate and is swapped with the current one. Integer images are rounded at each iteration,
+		their velocity being computed one row at a time in floating point (see _smooth_rows()).
+    */
+    template<typename F>
+    CImg<T>& smooth_iterate(const unsigned int iter, F checkpoint) {
+    	if (is_empty() || !iter) return *this;
+    	if (_is_shared) {
+    		CImg<T> img(*this,false);
+    		img.smooth_iterate(iter,checkpoint);
+    		return assign(img);
+    	}
+    	CImg<T> next(_width,_height,_depth,_spectrum);
+    	for (unsigned int i = 1; i<=iter; ++i) {
+    		if (cimg::type<T>::is_float()) {
+    			const float betamax = _smooth_velocity(next), factor = betamax>0?40.0f/betamax:0;
+    			const T *const ptrs = _data;
+    			T *const ptrd = next._data;
+    			cimg_pragma_openmp(parallel for cimg_openmp_if_size(size(),65536))
+    			for (longT off = 0; off<(longT)size(); ++off) ptrd[off] = (T)(ptrs[off] + (float)(ptrd[off]*factor));
+    		} else {
+    			const float betamax = _smooth_rows(next,0,false), factor = betamax>0?40.0f/betamax:0;
+    			_smooth_rows(next,factor,true);
+    		}
+    		next.swap(*this);
+    		checkpoint(i,*this);
+    	}
+    	return *this;
+    }
+
+    CImg<T>& smooth_iterate(const unsigned int iter) {
+    	return smooth_iterate(iter,_smooth_ignore());
+    }
+
+    // [internal] Compute the PDE velocity field of the image into veloc, return its maximum magnitude.
+    /*
+		Rows are processed in parallel, each thread keeping the maximum of its rows.
+    */
+    float _smooth_velocity(CImg<T>& veloc) const {
+    	const int h = height(), d = depth(), s = spectrum();
+    	float betamax = 0;
+    	cimg_pragma_openmp(parallel cimg_openmp_if_size(size(),16384)) {
+    		float _betamax = 0;
+    		cimg_pragma_openmp(for cimg_openmp_collapse(3))
+    		for (int c = 0; c<s; ++c) for (int z = 0; z<d; ++z) for (int y = 0; y<h; ++y) {
+    			const float m = cimg::smooth_velocity(veloc.data(0,y,z,c),data(0,y?y - 1:0,z,c),data(0,y,z,c),
+    			                                      data(0,y<h - 1?y + 1:y,z,c),width());
+    			if (m>_betamax) _betamax = m;
+    		}
+    		cimg_pragma_openmp(critical(_smooth_velocity)) if (_betamax>betamax) betamax = _betamax;
+    	}
+    	return betamax;
+    }
+
+    // [internal] Same for integer images, through float copies of the three rows around each row.
+    /*
+		The velocity is not kept: the first call returns its maximum magnitude, the second one
+		(is_update) computes it again to write the next iterate, rounded, into next.
+		Each thread takes consecutive rows, so it converts one new row per row.
+    */
+    float _smooth_rows(CImg<T>& next, const float factor, const bool is_update) const {
+    	const int w = width(), h = height(), d = depth(), s = spectrum();
+    	const float vmin = (float)cimg::type<T>::min(), vmax = (float)cimg::type<T>::max();
+    	float betamax = 0;
+    	cimg_pragma_openmp(parallel cimg_openmp_if_size(size(),16384)) {
+    		CImg<float> buffer(4*w);
+    		float *const veloc = buffer._data, *rows[] = { veloc + w, veloc + 2*w, veloc + 3*w };
+    		float _betamax = 0;
+    		int py = -1, pz = -1, pc = -1;
+    		cimg_pragma_openmp(for cimg_openmp_collapse(3))
+    		for (int c = 0; c<s; ++c) for (int z = 0; z<d; ++z) for (int y = 0; y<h; ++y) {
+    			const int yn = y<h - 1?y + 1:y;
+    			if (y && y==py + 1 && z==pz && c==pc) {
+    				float *const row = rows[0];
+    				rows[0] = rows[1]; rows[1] = rows[2]; rows[2] = row;
+    				const T *const ptrs = data(0,yn,z,c);
+    				for (int x = 0; x<w; ++x) row[x] = (float)ptrs[x];
+    			} else for (int k = 0; k<3; ++k) {
+    				const T *const ptrs = data(0,k?(k==1?y:yn):(y?y - 1:0),z,c);
+    				for (int x = 0; x<w; ++x) rows[k][x] = (float)ptrs[x];
+    			}
+    			py = y; pz = z; pc = c;
+    			const float m = cimg::smooth_velocity(veloc,rows[0],rows[1],rows[2],w);
+    			if (is_update) {
+    				T *const ptrd = next.data(0,y,z,c);
+    				const float *const ptrc = rows[1];
+    				if (vmin<0) for (int x = 0; x<w; ++x)
+    					ptrd[x] = cimg::type<T>::cut(cimg::round(ptrc[x] + (float)(veloc[x]*factor)));
+    				else for (int x = 0; x<w; ++x)
+    					ptrd[x] = (T)(std::min(std::max(ptrc[x] + (float)(veloc[x]*factor),0.f),vmax) + 0.5f);
+    			} else if (m>_betamax) _betamax = m;
+    		}
+    		cimg_pragma_openmp(critical(_smooth_rows)) if (_betamax>betamax) betamax = _betamax;
+    	}
+    	return betamax;
+    }
 
 	// Get Nth smmothed image in range of total iterations
 	/*
 	 * index, total iteration times
 	*/
-	CImg<T> get_smooth(const int index, const int iter) {
-		if (index >= iter) return CImg<T>(*this, false);
-		CImgList<T> list = CImg<T>(*this, false).smooth(iter);
-		return list[index];
+	CImg<T> get_smooth(const int index, const int iter) const {
+		CImg<T> res(*this,false);
+		if (index>0 && index<iter) res.smooth_iterate(index);
+		return res;
 	}
 
 
@@ -56209,28 +56604,88 @@ namespace cimg_library_suffixed {
 	CImg<T>& blur_gradient(const double sigma=0) {
 		if (is_empty()) return *this;
     	if (!cimg::type<T>::is_float()) {
-    		return CImg<Tfloat>(*this).blur_gradient(sigma);
+    		// The recursive blur runs one line at a time in floating point, as blur() does
+    		const float nsigma = (float)cimg::abs(30*std::cos(sigma));
+    		char axes[3];
+    		int nb_axes = 0;
+    		if (_width>1) axes[nb_axes++] = 'x';
+    		if (_height>1) axes[nb_axes++] = 'y';
+    		if (_depth>1) axes[nb_axes++] = 'z';
+    		if (!nb_axes) return normalize(0,255);
+    		float m = 0, M = 0;
+    		for (int k = 0; k<nb_axes - 1; ++k) _blur_lines(nsigma,axes[k],0,m,M);
+    		_blur_lines(nsigma,axes[nb_axes - 1],1,m,M);
+    		if (m==M) return fill((T)0);
+    		return _blur_lines(nsigma,axes[nb_axes - 1],2,m,M);
     	}
     	*this = (*this).get_blur((float)cimg::abs(30*std::cos(sigma))).normalize(0,255);
   		return *this;
 	}
 
-	// New instance of blur gradient image
-	CImg<Tfloat> get_blur_gradient(const double sigma=0) {
+	// [internal] Deriche blur of the lines of an integer image along axis, in floating point.
+	/*
+	 * mode 0 rounds the blurred lines back to T, mode 1 only returns their extrema in m and M,
+	 * and mode 2 writes them mapped from [m,M] to [0,255], so the last axis is rounded once.
+	 */
+	CImg<T>& _blur_lines(const float sigma, const char axis, const int mode, float& m, float& M) {
+		const unsigned int N = axis=='x'?_width:axis=='y'?_height:_depth;
+		const ulongT off = axis=='x'?1:axis=='y'?(ulongT)_width:(ulongT)_width*_height, nb_lines = size()/N;
+		const float fm = m, fM = M;
+		if (mode==1) { m = cimg::type<float>::max(); M = -m; }
+		cimg_pragma_openmp(parallel cimg_openmp_if_size(size(),16384)) {
+			CImg<Tfloat> line(N);
+			float _m = cimg::type<float>::max(), _M = -_m;
+			cimg_pragma_openmp(for)
+			for (longT l = 0; l<(longT)nb_lines; ++l) {
+				T *const ptr = _data + (ulongT)l%off + (ulongT)l/off*off*N;
+				cimg_forX(line,i) line[i] = (Tfloat)ptr[i*off];
+				line.deriche(sigma,0,'x');
+				switch (mode) {
+				case 0 : cimg_forX(line,i) ptr[i*off] = cimg::type<T>::cut(cimg::round(line[i])); break;
+				case 1 : cimg_forX(line,i) { const float v = (float)line[i]; if (v<_m) _m = v; if (v>_M) _M = v; } break;
+				default : cimg_forX(line,i) ptr[i*off] = cimg::type<T>::cut(cimg::round(((float)line[i] - fm)/(fM - fm)*255));
+				}
+			}
+			if (mode==1) {
+				cimg_pragma_openmp(critical(_blur_lines)) { if (_m<m) m = _m; if (_M>M) M = _M; }
+			}
+		}
+		return *this;
+	}
+
+	// New instance of blur gradient image, in floating point (blur_gradient() of a copy stays in T)
+	CImg<Tfloat> get_blur_gradient(const double sigma=0) const {
 		return CImg<Tfloat>(*this, false).blur_gradient(sigma);
 	}
 
 	// Exposure adjustment
+	/*
+	 * Integer values are rounded and saturated, 8 and 16-bit ones through a lookup table
+	 */
 	CImg<T>& exposure(const double param) {
 		if (is_empty()) return *this;
 		if (!cimg::type<T>::is_float()) {
-    		return CImg<Tfloat>(*this).exposure(param);
-    	}
+			const double vmin = (double)cimg::type<T>::min(), vmax = (double)cimg::type<T>::max();
+			if (sizeof(T)<=2 && size()>(cimg_ulong)(vmax - vmin)) {
+				CImg<T> lut((unsigned int)(vmax - vmin + 1));
+				cimg_forX(lut,i) lut[i] = _exposure_value(vmin + i,param);
+				T *const ptr = _data;
+				cimg_pragma_openmp(parallel for cimg_openmp_if_size(size(),65536))
+				for (longT off = 0; off<(longT)size(); ++off) ptr[off] = lut[(int)((double)ptr[off] - vmin)];
+			} else cimg_rof(*this,ptr,T) *ptr = _exposure_value((double)*ptr,param);
+			return *this;
+		}
 	  	cimg_forXYZC(*this,x,y,z,k) (*this)(x,y,z,k) = std::pow((double)(*this)(x,y,z,k),1.0/param);
 	  	return *this;
 	}
 
-	CImg<Tfloat> get_exposure(const double gamma=1) {
+	static T _exposure_value(const double value, const double param) {
+		const double res = std::pow(value,1.0/param);
+		return cimg::type<double>::is_nan(res)?(T)0:cimg::type<T>::cut(cimg::round(res));
+	}
+
+	// New instance of exposure image, in floating point as well
+	CImg<Tfloat> get_exposure(const double gamma=1) const {
 		return CImg<Tfloat>(*this, false).exposure(gamma);
 	}
     //@}
@@ -4,255 +4,3703 @@
                         Layer Manipulation Toolkit
 */
 #include "CImg.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <type_traits>
+#if cimg_OS==1
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 using namespace cimg_library;
 
 namespace cimg_extension {
+    // Blend modes
+    /*
+        How merge_layer() combines a layer pixel b with the pixel a below it.
+        Values are on [0,white], white being 255 for floating-point images
+        and the type maximum for integer images.
+    */
+    enum Blend_Mode {
+        blend_normal,       // b
+        blend_multiply,     // a*b/white
+        blend_screen,       // a + b - a*b/white
+        blend_overlay,      // multiply if a<white/2, screen otherwise (both doubled)
+        blend_add,          // min(a + b, white)
+        blend_darken,       // min(a, b)
+        blend_lighten       // max(a, b)
+    };
+
+    // Fixed-point arithmetic of 8 and 16-bit pixels
+    /*
+        Values and opacities are integers on [0,white], white = 2^bits - 1,
+        held in Tw, twice as wide as the pixel type. Products are divided by
+        white with rounding to nearest, exactly for any product of two values,
+        as (x + 2^(bits-1) + ((x + 2^(bits-1)) >> bits)) >> bits.
+    */
+    template<typename T> struct _Fixed;
+    template<> struct _Fixed<unsigned char> { typedef unsigned short type; };
+    template<> struct _Fixed<unsigned short> { typedef unsigned int type; };
+
+    template<typename T>
+    struct _is_fixed: std::integral_constant<bool, std::is_same<T, unsigned char>::value ||
+                                                   std::is_same<T, unsigned short>::value> {};
+
+    template<typename Tw>
+    inline Tw _div_white(const Tw x) {
+        const unsigned int bits = 4*sizeof(Tw);
+        const Tw y = (Tw)(x + ((Tw)1 << (bits - 1)));
+        return (Tw)((y + (y >> bits)) >> bits);
+    }
+
+#if cimg_use_simd!=0
+    // Same on 16-bit (8-bit pixels) and 32-bit lanes (16-bit pixels)
+    /*
+        For 16-bit lanes, (y + (y >> 8)) >> 8 is the high half of y*257.
+    */
+    cimg_simd_target("avx2") inline __m256i _div_white_epu16(const __m256i x) {
+        return _mm256_mulhi_epu16(_mm256_add_epi16(x, _mm256_set1_epi16(128)), _mm256_set1_epi16(257));
+    }
+
+    cimg_simd_target("avx512f,avx512bw") inline __m512i _div_white_epu16(const __m512i x) {
+        return _mm512_mulhi_epu16(_mm512_add_epi16(x, _mm512_set1_epi16(128)), _mm512_set1_epi16(257));
+    }
+
+    cimg_simd_target("avx2") inline __m256i _div_white_epu32(const __m256i x) {
+        const __m256i y = _mm256_add_epi32(x, _mm256_set1_epi32(32768));
+        return _mm256_srli_epi32(_mm256_add_epi32(y, _mm256_srli_epi32(y, 16)), 16);
+    }
+
+    cimg_simd_target("avx512f") inline __m512i _div_white_epu32(const __m512i x) {
+        const __m512i y = _mm512_add_epi32(x, _mm512_set1_epi32(32768));
+        const __mmask16 all = 0xFFFF;
+        return _mm512_maskz_srli_epi32(all, _mm512_add_epi32(y, _mm512_maskz_srli_epi32(all, y, 16)), 16);
+    }
+#endif
+
+    // Blend operators, in float and in fixed point, scalar and on AVX2 and AVX-512 vectors
+    struct _blend_normal {
+        static float apply(const float, const float b, const float, const float) {
+            return b;
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw, const Tw b, const Tw) {
+            return b;
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256, const __m256 b, const __m256, const __m256) {
+            return b;
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512, const __m512 b, const __m512, const __m512) {
+            return b;
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i, const __m256i b, const __m256i) {
+            return b;
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i, const __m512i b, const __m512i) {
+            return b;
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i, const __m256i b, const __m256i) {
+            return b;
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i, const __m512i b, const __m512i) {
+            return b;
+        }
+#endif
+    };
+
+    struct _blend_multiply {
+        static float apply(const float a, const float b, const float, const float iwhite) {
+            return a*b*iwhite;
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw) {
+            return _div_white((Tw)(a*b));
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256, const __m256 iwhite) {
+            return _mm256_mul_ps(_mm256_mul_ps(a, b), iwhite);
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512, const __m512 iwhite) {
+            return _mm512_mul_ps(_mm512_mul_ps(a, b), iwhite);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i) {
+            return _div_white_epu16(_mm256_mullo_epi16(a, b));
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i) {
+            return _div_white_epu16(_mm512_mullo_epi16(a, b));
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i) {
+            return _div_white_epu32(_mm256_mullo_epi32(a, b));
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i) {
+            return _div_white_epu32(_mm512_mullo_epi32(a, b));
+        }
+#endif
+    };
+
+    struct _blend_screen {
+        static float apply(const float a, const float b, const float, const float iwhite) {
+            return a + b - a*b*iwhite;
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw) {
+            return (Tw)(a + b - _div_white((Tw)(a*b)));
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256, const __m256 iwhite) {
+            return _mm256_sub_ps(_mm256_add_ps(a, b), _mm256_mul_ps(_mm256_mul_ps(a, b), iwhite));
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512, const __m512 iwhite) {
+            return _mm512_sub_ps(_mm512_add_ps(a, b), _mm512_mul_ps(_mm512_mul_ps(a, b), iwhite));
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_sub_epi16(_mm256_add_epi16(a, b), _div_white_epu16(_mm256_mullo_epi16(a, b)));
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_sub_epi16(_mm512_add_epi16(a, b), _div_white_epu16(_mm512_mullo_epi16(a, b)));
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_sub_epi32(_mm256_add_epi32(a, b), _div_white_epu32(_mm256_mullo_epi32(a, b)));
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_sub_epi32(_mm512_add_epi32(a, b), _div_white_epu32(_mm512_mullo_epi32(a, b)));
+        }
+#endif
+    };
+
+    struct _blend_overlay {
+        static float apply(const float a, const float b, const float white, const float iwhite) {
+            return 2*a < white ? 2*a*b*iwhite : white - 2*(white - a)*(white - b)*iwhite;
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw white) {
+            // Both doubled products stay below white*white.
+            return 2*a < white ? _div_white((Tw)(2*a*b)) : (Tw)(white - _div_white((Tw)(2*(white - a)*(white - b))));
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256 white, const __m256 iwhite) {
+            const __m256
+                a2 = _mm256_add_ps(a, a), ca = _mm256_sub_ps(white, a),
+                multiply = _mm256_mul_ps(_mm256_mul_ps(a2, b), iwhite),
+                screen = _mm256_sub_ps(white, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(ca, ca), _mm256_sub_ps(white, b)), iwhite));
+            return _mm256_blendv_ps(screen, multiply, _mm256_cmp_ps(a2, white, _CMP_LT_OQ));
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512 white, const __m512 iwhite) {
+            const __m512
+                a2 = _mm512_add_ps(a, a), ca = _mm512_sub_ps(white, a),
+                multiply = _mm512_mul_ps(_mm512_mul_ps(a2, b), iwhite),
+                screen = _mm512_sub_ps(white, _mm512_mul_ps(_mm512_mul_ps(_mm512_add_ps(ca, ca), _mm512_sub_ps(white, b)), iwhite));
+            return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a2, white, _CMP_LT_OQ), screen, multiply);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i white) {
+            const __m256i
+                a2 = _mm256_add_epi16(a, a), ca = _mm256_sub_epi16(white, a),
+                multiply = _div_white_epu16(_mm256_mullo_epi16(a2, b)),
+                screen = _mm256_sub_epi16(white, _div_white_epu16(_mm256_mullo_epi16(_mm256_add_epi16(ca, ca), _mm256_sub_epi16(white, b))));
+            return _mm256_blendv_epi8(screen, multiply, _mm256_cmpgt_epi16(white, a2));
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i white) {
+            const __m512i
+                a2 = _mm512_add_epi16(a, a), ca = _mm512_sub_epi16(white, a),
+                multiply = _div_white_epu16(_mm512_mullo_epi16(a2, b)),
+                screen = _mm512_sub_epi16(white, _div_white_epu16(_mm512_mullo_epi16(_mm512_add_epi16(ca, ca), _mm512_sub_epi16(white, b))));
+            return _mm512_mask_blend_epi16(_mm512_cmplt_epu16_mask(a2, white), screen, multiply);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i white) {
+            const __m256i
+                a2 = _mm256_add_epi32(a, a), ca = _mm256_sub_epi32(white, a),
+                multiply = _div_white_epu32(_mm256_mullo_epi32(a2, b)),
+                screen = _mm256_sub_epi32(white, _div_white_epu32(_mm256_mullo_epi32(_mm256_add_epi32(ca, ca), _mm256_sub_epi32(white, b))));
+            return _mm256_blendv_epi8(screen, multiply, _mm256_cmpgt_epi32(white, a2));
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i white) {
+            const __m512i
+                a2 = _mm512_add_epi32(a, a), ca = _mm512_sub_epi32(white, a),
+                multiply = _div_white_epu32(_mm512_mullo_epi32(a2, b)),
+                screen = _mm512_sub_epi32(white, _div_white_epu32(_mm512_mullo_epi32(_mm512_add_epi32(ca, ca), _mm512_sub_epi32(white, b))));
+            return _mm512_mask_blend_epi32(_mm512_cmplt_epu32_mask(a2, white), screen, multiply);
+        }
+#endif
+    };
+
+    struct _blend_add {
+        static float apply(const float a, const float b, const float white, const float) {
+            return std::min(a + b, white);
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw white) {
+            return std::min((Tw)(a + b), white);
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256 white, const __m256) {
+            return _mm256_min_ps(_mm256_add_ps(a, b), white);
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512 white, const __m512) {
+            // Zero-masked forms avoid the undefined start register of min and max.
+            return _mm512_maskz_min_ps(0xFFFF, _mm512_add_ps(a, b), white);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i white) {
+            return _mm256_min_epu16(_mm256_add_epi16(a, b), white);
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i white) {
+            return _mm512_min_epu16(_mm512_add_epi16(a, b), white);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i white) {
+            return _mm256_min_epu32(_mm256_add_epi32(a, b), white);
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i white) {
+            return _mm512_maskz_min_epu32(0xFFFF, _mm512_add_epi32(a, b), white);
+        }
+#endif
+    };
+
+    struct _blend_darken {
+        static float apply(const float a, const float b, const float, const float) {
+            return std::min(a, b);
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw) {
+            return std::min(a, b);
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256, const __m256) {
+            return _mm256_min_ps(b, a);
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512, const __m512) {
+            return _mm512_maskz_min_ps(0xFFFF, b, a);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_min_epu16(a, b);
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_min_epu16(a, b);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_min_epu32(a, b);
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_maskz_min_epu32(0xFFFF, a, b);
+        }
+#endif
+    };
+
+    struct _blend_lighten {
+        static float apply(const float a, const float b, const float, const float) {
+            return std::max(a, b);
+        }
+        template<typename Tw> static Tw apply_fixed(const Tw a, const Tw b, const Tw) {
+            return std::max(a, b);
+        }
+#if cimg_use_simd!=0
+        cimg_simd_target("avx2") static __m256 apply(const __m256 a, const __m256 b, const __m256, const __m256) {
+            return _mm256_max_ps(b, a);
+        }
+        cimg_simd_target("avx512f") static __m512 apply(const __m512 a, const __m512 b, const __m512, const __m512) {
+            return _mm512_maskz_max_ps(0xFFFF, b, a);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu16(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_max_epu16(a, b);
+        }
+        cimg_simd_target("avx512f,avx512bw") static __m512i apply_epu16(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_max_epu16(a, b);
+        }
+        cimg_simd_target("avx2") static __m256i apply_epu32(const __m256i a, const __m256i b, const __m256i) {
+            return _mm256_max_epu32(a, b);
+        }
+        cimg_simd_target("avx512f") static __m512i apply_epu32(const __m512i a, const __m512i b, const __m512i) {
+            return _mm512_maskz_max_epu32(0xFFFF, a, b);
+        }
+#endif
+    };
+
+    // Blend n pixels with mode Op, as ptrd = nopacity*Op(ptrd,ptrs) + copacity*ptrd
+    template<typename Op, typename T>
+    inline void _blend_loop(T *const ptrd, const T *const ptrs, const unsigned int n,
+                            const float nopacity, const float copacity, const float white) {
+        const float iwhite = 1/white;
+        for (unsigned int i = 0; i < n; ++i) {
+            const float a = (float)ptrd[i];
+            ptrd[i] = (T)(nopacity*Op::apply(a, (float)ptrs[i], white, iwhite) + a*copacity);
+        }
+    }
+
+    // Same in fixed point, opacity being an integer on [0,white]
+    template<typename Op, typename T>
+    inline void _blend_fixed_loop(T *const ptrd, const T *const ptrs, const unsigned int n,
+                                  const unsigned int opacity) {
+        typedef typename _Fixed<T>::type Tw;
+        const Tw white = (Tw)cimg::type<T>::max(), nopacity = (Tw)opacity, copacity = (Tw)(white - opacity);
+        for (unsigned int i = 0; i < n; ++i) {
+            const Tw a = ptrd[i];
+            ptrd[i] = (T)_div_white((Tw)(nopacity*Op::apply_fixed(a, (Tw)ptrs[i], white) + copacity*a));
+        }
+    }
+
+#if cimg_use_simd!=0
+    // Resolved once, as cimg::simd_level() does
+    inline bool _has_avx512bw() {
+        static const bool res = cimg::simd_level() >= 3 && __builtin_cpu_supports("avx512bw");
+        return res;
+    }
+
+    // SIMD versions of _blend_loop() for float pixels, returning the number of pixels processed
+    /*
+        They perform the operations of the scalar loop in the same order,
+        without contraction into fused multiply-adds.
+    */
+    template<typename Op> cimg_simd_target("avx2")
+    unsigned int _blend_avx2(float *const ptrd, const float *const ptrs, const unsigned int n,
+                             const float nopacity, const float copacity, const float white) {
+        const __m256
+            no = _mm256_set1_ps(nopacity), co = _mm256_set1_ps(copacity),
+            w = _mm256_set1_ps(white), iw = _mm256_set1_ps(1/white);
+        unsigned int i = 0;
+        for ( ; i + 8 <= n; i += 8) {
+            const __m256 a = _mm256_loadu_ps(ptrd + i);
+            _mm256_storeu_ps(ptrd + i, _mm256_add_ps(_mm256_mul_ps(no, Op::apply(a, _mm256_loadu_ps(ptrs + i), w, iw)),
+                                                     _mm256_mul_ps(a, co)));
+        }
+        return i;
+    }
+
+    template<typename Op> cimg_simd_target("avx512f")
+    unsigned int _blend_avx512(float *const ptrd, const float *const ptrs, const unsigned int n,
+                               const float nopacity, const float copacity, const float white) {
+        const __m512
+            no = _mm512_set1_ps(nopacity), co = _mm512_set1_ps(copacity),
+            w = _mm512_set1_ps(white), iw = _mm512_set1_ps(1/white);
+        unsigned int i = 0;
+        for ( ; i + 16 <= n; i += 16) {
+            const __m512 a = _mm512_loadu_ps(ptrd + i);
+            _mm512_storeu_ps(ptrd + i, _mm512_add_ps(_mm512_mul_ps(no, Op::apply(a, _mm512_loadu_ps(ptrs + i), w, iw)),
+                                                     _mm512_mul_ps(a, co)));
+        }
+        return i;
+    }
+
+    // Same in fixed point, for 8-bit pixels on 16-bit lanes and 16-bit pixels on 32-bit lanes
+    template<typename Op> cimg_simd_target("avx2")
+    unsigned int _blend_fixed_avx2(unsigned char *const ptrd, const unsigned char *const ptrs, const unsigned int n,
+                                   const unsigned int opacity) {
+        const __m256i
+            white = _mm256_set1_epi16(255), no = _mm256_set1_epi16((short)opacity),
+            co = _mm256_set1_epi16((short)(255 - opacity));
+        unsigned int i = 0;
+        for ( ; i + 16 <= n; i += 16) {
+            const __m256i
+                a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ptrd + i))),
+                b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(ptrs + i))),
+                res = _div_white_epu16(_mm256_add_epi16(_mm256_mullo_epi16(no, Op::apply_epu16(a, b, white)),
+                                                        _mm256_mullo_epi16(co, a)));
+            _mm_storeu_si128((__m128i*)(ptrd + i), _mm_packus_epi16(_mm256_castsi256_si128(res),
+                                                                    _mm256_extracti128_si256(res, 1)));
+        }
+        return i;
+    }
+
+    template<typename Op> cimg_simd_target("avx2")
+    unsigned int _blend_fixed_avx2(unsigned short *const ptrd, const unsigned short *const ptrs, const unsigned int n,
+                                   const unsigned int opacity) {
+        const __m256i
+            white = _mm256_set1_epi32(65535), no = _mm256_set1_epi32((int)opacity),
+            co = _mm256_set1_epi32((int)(65535 - opacity));
+        unsigned int i = 0;
+        for ( ; i + 8 <= n; i += 8) {
+            const __m256i
+                a = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(ptrd + i))),
+                b = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(ptrs + i))),
+                res = _div_white_epu32(_mm256_add_epi32(_mm256_mullo_epi32(no, Op::apply_epu32(a, b, white)),
+                                                        _mm256_mullo_epi32(co, a)));
+            _mm_storeu_si128((__m128i*)(ptrd + i), _mm_packus_epi32(_mm256_castsi256_si128(res),
+                                                                    _mm256_extracti128_si256(res, 1)));
+        }
+        return i;
+    }
+
+    template<typename Op> cimg_simd_target("avx512f,avx512bw")
+    unsigned int _blend_fixed_avx512(unsigned char *const ptrd, const unsigned char *const ptrs, const unsigned int n,
+                                     const unsigned int opacity) {
+        const __m512i
+            white = _mm512_set1_epi16(255), no = _mm512_set1_epi16((short)opacity),
+            co = _mm512_set1_epi16((short)(255 - opacity)), zero = _mm512_setzero_si512();
+        const __mmask32 all = 0xFFFFFFFF; // Masked forms avoid the undefined start registers of the conversions.
+        unsigned int i = 0;
+        for ( ; i + 32 <= n; i += 32) {
+            const __m512i
+                a = _mm512_mask_cvtepu8_epi16(zero, all, _mm256_loadu_si256((const __m256i*)(ptrd + i))),
+                b = _mm512_mask_cvtepu8_epi16(zero, all, _mm256_loadu_si256((const __m256i*)(ptrs + i))),
+                res = _div_white_epu16(_mm512_add_epi16(_mm512_mullo_epi16(no, Op::apply_epu16(a, b, white)),
+                                                        _mm512_mullo_epi16(co, a)));
+            _mm256_storeu_si256((__m256i*)(ptrd + i), _mm512_mask_cvtepi16_epi8(_mm256_setzero_si256(), all, res));
+        }
+        return i;
+    }
+
+    template<typename Op> cimg_simd_target("avx512f,avx512bw")
+    unsigned int _blend_fixed_avx512(unsigned short *const ptrd, const unsigned short *const ptrs, const unsigned int n,
+                                     const unsigned int opacity) {
+        const __m512i
+            white = _mm512_set1_epi32(65535), no = _mm512_set1_epi32((int)opacity),
+            co = _mm512_set1_epi32((int)(65535 - opacity)), zero = _mm512_setzero_si512();
+        const __mmask16 all = 0xFFFF;
+        unsigned int i = 0;
+        for ( ; i + 16 <= n; i += 16) {
+            const __m512i
+                a = _mm512_mask_cvtepu16_epi32(zero, all, _mm256_loadu_si256((const __m256i*)(ptrd + i))),
+                b = _mm512_mask_cvtepu16_epi32(zero, all, _mm256_loadu_si256((const __m256i*)(ptrs + i))),
+                res = _div_white_epu32(_mm512_add_epi32(_mm512_mullo_epi32(no, Op::apply_epu32(a, b, white)),
+                                                        _mm512_mullo_epi32(co, a)));
+            _mm256_storeu_si256((__m256i*)(ptrd + i), _mm512_mask_cvtepi32_epi16(_mm256_setzero_si256(), all, res));
+        }
+        return i;
+    }
+
+    // Blend n pixels with one of the kernels above, the last ones going through it on a padded copy
+    template<typename T, typename... Args>
+    void _blend_tail(unsigned int (*const kernel)(T*, const T*, unsigned int, Args...),
+                     T *const ptrd, const T *const ptrs, const unsigned int n, const Args... args) {
+        const unsigned int i = kernel(ptrd, ptrs, n, args...);
+        if (i < n) {
+            T bufd[64] = { 0 }, bufs[64] = { 0 };
+            std::memcpy(bufd, ptrd + i, (n - i)*sizeof(T));
+            std::memcpy(bufs, ptrs + i, (n - i)*sizeof(T));
+            kernel(bufd, bufs, 64, args...);
+            std::memcpy(ptrd + i, bufd, (n - i)*sizeof(T));
+        }
+    }
+#endif
+
+    // Value of an opaque white pixel
+    template<typename T>
+    inline float _white() {
+        return cimg::type<T>::is_float() ? 255.f : (float)cimg::type<T>::max();
+    }
+
+    // Multiply the colors of img by alpha/white, alpha being a plane of its size
+    template<typename T>
+    void _premultiply(CImg<T>& img, const CImg<T>& alpha) {
+        const float iwhite = 1/_white<T>(), rounding = cimg::type<T>::is_float() ? 0 : 0.5f;
+        const std::size_t n = alpha.size();
+        cimg_forC(img, c) {
+            T *const ptr = img.data(0, 0, 0, c);
+            for (std::size_t i = 0; i < n; ++i) ptr[i] = (T)((float)ptr[i]*alpha[i]*iwhite + rounding);
+        }
+    }
+
+    // Divide them back, transparent colors becoming 0, so that filters see the unpremultiplied colors
+    template<typename T>
+    void _unpremultiply(CImg<T>& img, const CImg<T>& alpha) {
+        const float white = _white<T>(), rounding = cimg::type<T>::is_float() ? 0 : 0.5f;
+        const std::size_t n = alpha.size();
+        cimg_forC(img, c) {
+            T *const ptr = img.data(0, 0, 0, c);
+            for (std::size_t i = 0; i < n; ++i) {
+                const float a = (float)alpha[i];
+                ptr[i] = a > 0 ? (T)cimg::type<T>::cut((float)ptr[i]*white/a + rounding) : (T)0;
+            }
+        }
+    }
+
+    // Opacity on [0,1] as a fixed-point integer on [0,white]
+    template<typename T>
+    inline unsigned int _fixed_opacity(const float opacity) {
+        return (unsigned int)(opacity*cimg::type<T>::max() + 0.5f);
+    }
+
+    template<typename Op, typename T>
+    void _blend_span(T *const ptrd, const T *const ptrs, const unsigned int n, const float opacity, std::false_type) {
+        _blend_loop<Op>(ptrd, ptrs, n, opacity, 1 - opacity, _white<T>());
+    }
+
+#if cimg_use_simd!=0
+    template<typename Op>
+    void _blend_span(float *const ptrd, const float *const ptrs, const unsigned int n, const float opacity, std::false_type) {
+        switch (cimg::simd_level()) {
+        case 3: _blend_tail(_blend_avx512<Op>, ptrd, ptrs, n, opacity, 1 - opacity, 255.f); return;
+        case 2: _blend_tail(_blend_avx2<Op>, ptrd, ptrs, n, opacity, 1 - opacity, 255.f); return;
+        }
+        _blend_loop<Op>(ptrd, ptrs, n, opacity, 1 - opacity, 255.f);
+    }
+#endif
+
+    template<typename Op, typename T>
+    void _blend_span(T *const ptrd, const T *const ptrs, const unsigned int n, const float opacity, std::true_type) {
+        const unsigned int nopacity = _fixed_opacity<T>(opacity);
+#if cimg_use_simd!=0
+        switch (cimg::simd_level()) {
+        case 3: if (_has_avx512bw()) { _blend_tail(_blend_fixed_avx512<Op>, ptrd, ptrs, n, nopacity); return; }
+            // fall through
+        case 2: _blend_tail(_blend_fixed_avx2<Op>, ptrd, ptrs, n, nopacity); return;
+        }
+#endif
+        _blend_fixed_loop<Op>(ptrd, ptrs, n, nopacity);
+    }
+
+    // Blend n pixels with mode Op and opacity, in fixed point for 8 and 16-bit pixels
+    template<typename Op, typename T>
+    void _blend_span(T *const ptrd, const T *const ptrs, const unsigned int n, const float opacity) {
+        _blend_span<Op>(ptrd, ptrs, n, opacity, _is_fixed<T>());
+    }
+
+    // Blend n partially transparent pixels with mode Op, ptrs being premultiplied by alpha ptra
+    /*
+        The layer pixel is unpremultiplied and blended with opacity*alpha/white.
+    */
+    template<typename Op, typename T>
+    void _blend_alpha_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                           const float opacity, std::false_type) {
+        const float white = _white<T>(), iwhite = 1/white;
+        for (unsigned int i = 0; i < n; ++i) {
+            const float a = (float)ptrd[i], alpha = (float)ptra[i]*iwhite, nopacity = opacity*alpha;
+            ptrd[i] = (T)(nopacity*Op::apply(a, (float)ptrs[i]/alpha, white, iwhite) + a*(1 - nopacity));
+        }
+    }
+
+    template<typename Op, typename T>
+    void _blend_alpha_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                           const float opacity, std::true_type) {
+        typedef typename _Fixed<T>::type Tw;
+        const Tw white = (Tw)cimg::type<T>::max(), nopacity = (Tw)_fixed_opacity<T>(opacity);
+        for (unsigned int i = 0; i < n; ++i) {
+            // Alpha is neither 0 nor white here.
+            const unsigned int alpha = ptra[i], b = std::min(((unsigned int)ptrs[i]*white + alpha/2)/alpha, (unsigned int)white);
+            const Tw a = ptrd[i], na = _div_white((Tw)(nopacity*alpha));
+            ptrd[i] = (T)_div_white((Tw)(na*Op::apply_fixed(a, (Tw)b, white) + (white - na)*a));
+        }
+    }
+
+    template<typename Op, typename T>
+    void _blend_alpha_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                           const float opacity) {
+        _blend_alpha_span<Op>(ptrd, ptrs, ptra, n, opacity, _is_fixed<T>());
+    }
+
+    // Premultiplied 'over' of n partially transparent pixels: opacity*ptrs + (1 - opacity*ptra/white)*ptrd
+    template<typename T>
+    void _blend_over_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                          const float opacity, std::false_type) {
+        const float iwhite = 1/_white<T>();
+        for (unsigned int i = 0; i < n; ++i) {
+            ptrd[i] = (T)(opacity*ptrs[i] + (1 - opacity*ptra[i]*iwhite)*ptrd[i]);
+        }
+    }
+
+    template<typename T>
+    void _blend_over_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                          const float opacity, std::true_type) {
+        typedef typename _Fixed<T>::type Tw;
+        const Tw white = (Tw)cimg::type<T>::max(), nopacity = (Tw)_fixed_opacity<T>(opacity);
+        for (unsigned int i = 0; i < n; ++i) {
+            // Both terms are rounded apart, so the sum may exceed white by one.
+            const Tw na = _div_white((Tw)(nopacity*ptra[i]));
+            ptrd[i] = (T)std::min((Tw)(_div_white((Tw)(nopacity*ptrs[i])) + _div_white((Tw)((white - na)*ptrd[i]))), white);
+        }
+    }
+
+    template<typename T>
+    void _blend_over_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                          const float opacity) {
+        _blend_over_span(ptrd, ptrs, ptra, n, opacity, _is_fixed<T>());
+    }
+
+    // Storage formats of floating-point layers (see Layer<T>::set_storage())
+    enum Storage_Format {
+        storage_native,     // T
+        storage_half,       // IEEE 754 binary16: 11 significant bits, up to 65504
+        storage_bfloat16    // upper half of a float: 8 significant bits, float range
+    };
+
+    // Conversions between float and 16-bit floats, rounding to nearest even
+    inline unsigned short _float_to_half(const float value) {
+        unsigned int x;
+        std::memcpy(&x, &value, 4);
+        const unsigned int sign = (x >> 16) & 0x8000;
+        x &= 0x7fffffff;
+        if (x > 0x7f800000) return (unsigned short)(sign | 0x7e00 | ((x >> 13) & 0x3ff));   // NaN
+        if (x >= 0x47800000) return (unsigned short)(sign | 0x7c00);                         // infinity
+        if (x < 0x38800000) {
+            // Subnormal half
+            if (x < 0x33000000) return (unsigned short)sign;
+            const unsigned int shift = 126 - (x >> 23), m = (x & 0x7fffff) | 0x800000, rem = m & ((1U << shift) - 1);
+            unsigned int res = m >> shift;
+            if (rem > (1U << (shift - 1)) || (rem == (1U << (shift - 1)) && (res & 1))) ++res;
+            return (unsigned short)(sign | res);
+        }
+        unsigned int res = (x - 0x38000000) >> 13;
+        const unsigned int rem = x & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (res & 1))) ++res;
+        return (unsigned short)(sign | res);
+    }
+
+    inline float _half_to_float(const unsigned short value) {
+        const unsigned int sign = (unsigned int)(value & 0x8000) << 16, e = (value >> 10) & 0x1f, m = value & 0x3ff;
+        unsigned int x;
+        if (e == 31) x = sign | 0x7f800000 | (m << 13);
+        else if (e) x = sign | ((e + 112) << 23) | (m << 13);
+        else if (!m) x = sign;
+        else {
+            // Subnormal half, normalized
+            unsigned int k = 0, mm = m << 1;
+            while (!(mm & 0x400)) { ++k; mm <<= 1; }
+            x = sign | ((112 - k) << 23) | ((mm & 0x3ff) << 13);
+        }
+        float res;
+        std::memcpy(&res, &x, 4);
+        return res;
+    }
+
+    inline unsigned short _float_to_bfloat16(const float value) {
+        unsigned int x;
+        std::memcpy(&x, &value, 4);
+        if ((x & 0x7fffffff) > 0x7f800000) return (unsigned short)((x >> 16) | 0x40);
+        return (unsigned short)((x + 0x7fff + ((x >> 16) & 1)) >> 16);
+    }
+
+    inline float _bfloat16_to_float(const unsigned short value) {
+        const unsigned int x = (unsigned int)value << 16;
+        float res;
+        std::memcpy(&res, &x, 4);
+        return res;
+    }
+
+#if cimg_use_simd!=0
+    inline bool _has_f16c() {
+        static const bool res = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+        return res;
+    }
+
+    // Vector conversions of the first n/8*8 values, returning how many were converted
+    cimg_simd_target("avx2,f16c")
+    inline std::size_t _narrow_f16c(unsigned short *const ptrd, const float *const ptrs, const std::size_t n,
+                                    const Storage_Format format) {
+        std::size_t i = 0;
+        if (format == storage_half) for ( ; i + 8 <= n; i += 8) {
+            _mm_storeu_si128((__m128i*)(ptrd + i), _mm256_cvtps_ph(_mm256_loadu_ps(ptrs + i), _MM_FROUND_TO_NEAREST_INT));
+        } else {
+            const __m256i one = _mm256_set1_epi32(1), round = _mm256_set1_epi32(0x7fff),
+                abs_mask = _mm256_set1_epi32(0x7fffffff), inf = _mm256_set1_epi32(0x7f800000),
+                quiet = _mm256_set1_epi32(0x40);
+            for ( ; i + 8 <= n; i += 8) {
+                const __m256i
+                    x = _mm256_loadu_si256((const __m256i*)(ptrs + i)),
+                    rounded = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, round),
+                                                                 _mm256_and_si256(_mm256_srli_epi32(x, 16), one)), 16),
+                    nan = _mm256_or_si256(_mm256_srli_epi32(x, 16), quiet),
+                    is_nan = _mm256_cmpgt_epi32(_mm256_and_si256(x, abs_mask), inf),
+                    res = _mm256_blendv_epi8(rounded, nan, is_nan),
+                    packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(res, res), 0x08);
+                _mm_storeu_si128((__m128i*)(ptrd + i), _mm256_castsi256_si128(packed));
+            }
+        }
+        return i;
+    }
+
+    cimg_simd_target("avx2,f16c")
+    inline std::size_t _widen_f16c(float *const ptrd, const unsigned short *const ptrs, const std::size_t n,
+                                   const Storage_Format format) {
+        std::size_t i = 0;
+        if (format == storage_half) for ( ; i + 8 <= n; i += 8) {
+            _mm256_storeu_ps(ptrd + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(ptrs + i))));
+        } else for ( ; i + 8 <= n; i += 8) {
+            const __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(ptrs + i)));
+            _mm256_storeu_si256((__m256i*)(ptrd + i), _mm256_slli_epi32(x, 16));
+        }
+        return i;
+    }
+#endif
+
+    // Convert n values to and from a 16-bit storage format
+    template<typename T>
+    void _narrow_span(unsigned short *const ptrd, const T *const ptrs, const std::size_t n, const Storage_Format format) {
+        std::size_t i = 0;
+#if cimg_use_simd!=0
+        if (std::is_same<T, float>::value && _has_f16c()) i = _narrow_f16c(ptrd, (const float*)ptrs, n, format);
+#endif
+        if (format == storage_half) for ( ; i < n; ++i) ptrd[i] = _float_to_half((float)ptrs[i]);
+        else for ( ; i < n; ++i) ptrd[i] = _float_to_bfloat16((float)ptrs[i]);
+    }
+
+    template<typename T>
+    void _widen_span(T *const ptrd, const unsigned short *const ptrs, const std::size_t n, const Storage_Format format) {
+        std::size_t i = 0;
+#if cimg_use_simd!=0
+        if (std::is_same<T, float>::value && _has_f16c()) i = _widen_f16c((float*)ptrd, ptrs, n, format);
+#endif
+        if (format == storage_half) for ( ; i < n; ++i) ptrd[i] = (T)_half_to_float(ptrs[i]);
+        else for ( ; i < n; ++i) ptrd[i] = (T)_bfloat16_to_float(ptrs[i]);
+    }
+
+    // Pool of pixel buffers, shared by the layers of type T
+    /*
+        Buffers freed by layers are kept in free lists of size classes
+        (4 per power of two) and handed out again for new layer storage:
+        copies, unshared pixels and merge_layer() results. Batch jobs on
+        images of the same size then stop going through new[] and page
+        faults. Pooling is off until set_budget() gives the maximum amount
+        of memory kept in the free lists (in bytes).
+        With set_hugepages(), buffers of at least 2 MB are advised to use
+        transparent huge pages (POSIX systems with MADV_HUGEPAGE only).
+        Buffers are allocated with new[], so pooled images remain ordinary
+        CImg<T> instances.
+    */
+    template<typename T>
+    class Pixel_Pool {
+        std::map<std::size_t, std::vector<T*> > _free;
+        std::size_t _budget, _pooled;
+        unsigned long _hits, _misses;
+        bool _is_huge;
+        mutable std::mutex _mutex;
+
+        Pixel_Pool(): _budget(0), _pooled(0), _hits(0), _misses(0), _is_huge(false) {}
+        Pixel_Pool(const Pixel_Pool&) = delete;
+        Pixel_Pool& operator=(const Pixel_Pool&) = delete;
+    public:
+        // Never destroyed, as layers may outlive any other static object
+        static Pixel_Pool& instance() {
+            static Pixel_Pool *const pool = new Pixel_Pool;
+            return *pool;
+        }
+
+        void set_budget(const std::size_t bytes) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _budget = bytes;
+            _trim();
+        }
+
+        std::size_t budget() const { std::lock_guard<std::mutex> lock(_mutex); return _budget; }
+
+        void set_hugepages(const bool is_huge) { std::lock_guard<std::mutex> lock(_mutex); _is_huge = is_huge; }
+        bool hugepages() const { std::lock_guard<std::mutex> lock(_mutex); return _is_huge; }
+
+        // Statistics
+        unsigned long hits() const { std::lock_guard<std::mutex> lock(_mutex); return _hits; }
+        unsigned long misses() const { std::lock_guard<std::mutex> lock(_mutex); return _misses; }
+        std::size_t pooled_bytes() const { std::lock_guard<std::mutex> lock(_mutex); return _pooled; }
+
+        // Free every pooled buffer
+        void clear() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            const std::size_t budget = _budget;
+            _budget = 0;
+            _trim();
+            _budget = budget;
+        }
+
+        // Buffer of at least n values, its size being returned in capacity
+        T* acquire(const std::size_t n, std::size_t& capacity) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_budget) {
+                capacity = n;
+                return new T[n];
+            }
+            capacity = _class_size(n);
+            typename std::map<std::size_t, std::vector<T*> >::iterator it = _free.find(capacity);
+            if (it != _free.end() && !it->second.empty()) {
+                T *const buf = it->second.back();
+                it->second.pop_back();
+                _pooled -= capacity*sizeof(T);
+                ++_hits;
+                return buf;
+            }
+            ++_misses;
+            T *const buf = new T[capacity];
+            if (_is_huge) _advise_huge(buf, capacity*sizeof(T));
+            return buf;
+        }
+
+        // Give back a buffer allocated with new[] and holding capacity values
+        void release(T *const buf, const std::size_t capacity) {
+            if (!buf) return;
+            std::lock_guard<std::mutex> lock(_mutex);
+            const std::size_t size = _floor_class_size(capacity), bytes = size*sizeof(T);
+            if (!size || _pooled + bytes > _budget) {
+                delete[] buf;
+                return;
+            }
+            _free[size].push_back(buf);
+            _pooled += bytes;
+        }
+
+        // Smallest size class holding n values, and largest one held by n values
+        static std::size_t _class_size(const std::size_t n) {
+            if (n <= 8) return n;
+            const std::size_t step = _class_step(n);
+            return (n + step - 1)/step*step;
+        }
+
+        static std::size_t _floor_class_size(const std::size_t n) {
+            if (n <= 8) return n;
+            const std::size_t step = _class_step(n);
+            return n/step*step;
+        }
+
+        static std::size_t _class_step(const std::size_t n) {
+            std::size_t step = 1;
+            while (n >= step*8) step*=2;
+            return step;
+        }
+
+    private:
+        // Free buffers until the pool fits in its budget.
+        void _trim() {
+            typename std::map<std::size_t, std::vector<T*> >::iterator it = _free.end();
+            while (_pooled > _budget && it != _free.begin()) {
+                --it;
+                while (_pooled > _budget && !it->second.empty()) {
+                    delete[] it->second.back();
+                    it->second.pop_back();
+                    _pooled -= it->first*sizeof(T);
+                }
+            }
+        }
+
+        static void _advise_huge(T *const buf, const std::size_t bytes) {
+#if cimg_OS==1 && defined(MADV_HUGEPAGE)
+            const std::size_t huge = 2*1024*1024;
+            const std::size_t
+                begin = ((std::size_t)buf + huge - 1)/huge*huge,
+                end = ((std::size_t)buf + bytes)/huge*huge;
+            if (end > begin) madvise((void*)begin, end - begin, MADV_HUGEPAGE);
+#else
+            cimg::unused(buf, bytes);
+#endif
+        }
+    };
+
+    template<typename T> class Tile_Store;
+
+    // Cache of the tiles of every Tile_Store<T>, under a memory budget
+    /*
+        Tiles are loaded on demand and evicted least recently used first,
+        modified tiles being written back to their store. Tiles handed out
+        (pinned) are never evicted until released, so the budget can be
+        exceeded by the tiles in use. Files are read outside the cache lock,
+        a tile being marked as loading meanwhile so that other threads
+        asking for it wait for the read instead of doing it twice.
+    */
+    template<typename T>
+    class Tile_Cache {
+        struct _Entry {
+            Tile_Store<T> *store;
+            std::size_t index;
+            std::shared_ptr<CImg<T> > tile;
+            bool is_dirty, is_loading;
+        };
+        typedef typename std::list<_Entry>::iterator _iterator;
+        typedef std::pair<const Tile_Store<T>*, std::size_t> _key;
+
+        std::list<_Entry> _entries;     // most recently used first
+        std::map<_key, _iterator> _index;
+        std::size_t _budget, _size;
+        unsigned long _hits, _misses, _evictions, _writes;
+        mutable std::mutex _mutex;
+        std::condition_variable _loaded;
+
+        Tile_Cache(): _budget(256*1024*1024), _size(0), _hits(0), _misses(0), _evictions(0), _writes(0) {}
+        Tile_Cache(const Tile_Cache&) = delete;
+        Tile_Cache& operator=(const Tile_Cache&) = delete;
+    public:
+        // Never destroyed, as tile stores may outlive any other static object
+        static Tile_Cache& instance() {
+            static Tile_Cache *const cache = new Tile_Cache;
+            return *cache;
+        }
+
+        // Memory budget of the cached tiles (in bytes, 256 MB by default)
+        void set_budget(const std::size_t bytes) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _budget = bytes;
+            _evict();
+        }
+
+        std::size_t budget() const { std::lock_guard<std::mutex> lock(_mutex); return _budget; }
+
+        // Statistics
+        std::size_t size() const { std::lock_guard<std::mutex> lock(_mutex); return _size; }
+        unsigned long hits() const { std::lock_guard<std::mutex> lock(_mutex); return _hits; }
+        unsigned long misses() const { std::lock_guard<std::mutex> lock(_mutex); return _misses; }
+        unsigned long evictions() const { std::lock_guard<std::mutex> lock(_mutex); return _evictions; }
+        unsigned long writes() const { std::lock_guard<std::mutex> lock(_mutex); return _writes; }
+
+        // Tile index of store, loaded if needed (is_write marks it modified)
+        std::shared_ptr<CImg<T> > get(Tile_Store<T>& store, const std::size_t index, const bool is_write) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            typename std::map<_key, _iterator>::iterator it;
+            while ((it = _index.find(_key(&store, index))) != _index.end() && it->second->is_loading) _loaded.wait(lock);
+            if (it != _index.end()) {
+                ++_hits;
+                _entries.splice(_entries.begin(), _entries, it->second);
+                it->second->is_dirty |= is_write;
+                return it->second->tile;
+            }
+            ++_misses;
+            const std::shared_ptr<CImg<T> > tile = std::make_shared<CImg<T> >(store.tile_width(), store.tile_height());
+            const _Entry entry = { &store, index, tile, is_write, true };
+            _entries.push_front(entry);
+            const _iterator pos = _entries.begin();    // stays valid, as the pinned tile is never evicted
+            _index[_key(&store, index)] = pos;
+            _size += tile->size()*sizeof(T);
+            lock.unlock();
+            store._read(index, *tile);
+            lock.lock();
+            pos->is_loading = false;
+            _loaded.notify_all();
+            _evict();
+            return tile;
+        }
+
+        // Write the modified tiles of store back to it, and forget them if is_dropped is set.
+        void flush(const Tile_Store<T> *const store, const bool is_dropped=false) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_is_loading(store)) _loaded.wait(lock);
+            for (_iterator it = _entries.begin(); it != _entries.end(); ) {
+                if (it->store != store) { ++it; continue; }
+                if (it->is_dirty && !is_dropped) {
+                    it->store->_write(it->index, *it->tile);
+                    it->is_dirty = false;
+                    ++_writes;
+                }
+                if (!is_dropped) { ++it; continue; }
+                _size -= it->tile->size()*sizeof(T);
+                _index.erase(_key(it->store, it->index));
+                it = _entries.erase(it);
+            }
+        }
+
+    private:
+        bool _is_loading(const Tile_Store<T> *const store) const {
+            for (const _Entry& entry : _entries) if (entry.store == store && entry.is_loading) return true;
+            return false;
+        }
+
+        // Evict unpinned tiles until the cache fits in its budget.
+        void _evict() {
+            _iterator it = _entries.end();
+            while (_size > _budget && it != _entries.begin()) {
+                --it;
+                if (it->tile.use_count() > 1) continue;
+                if (it->is_dirty) {
+                    it->store->_write(it->index, *it->tile);
+                    ++_writes;
+                }
+                _size -= it->tile->size()*sizeof(T);
+                _index.erase(_key(it->store, it->index));
+                it = _entries.erase(it);
+                ++_evictions;
+            }
+        }
+    };
+
+    // Image of size (w,h,d,s) split into tiles of (tile_width,tile_height) kept in a file
+    /*
+        Each channel plane is cut into tiles stored one after the other in
+        the file (border tiles being padded to the full tile size), and read
+        or written through Tile_Cache<T>. The file is a backing store for
+        the session, not an image format: it is created empty (a temporary
+        file when no filename is given, removed when the store is
+        destroyed), and a named file is kept up to date at destruction.
+    */
+    template<typename T>
+    class Tile_Store {
+        std::FILE *_file;
+        std::string _filename;
+        unsigned int _width, _height, _depth, _spectrum, _tile_width, _tile_height, _nx, _ny;
+        bool _is_temporary;
+        std::mutex _file_mutex;     // tiles are read outside the Tile_Cache lock
+
+        friend class Tile_Cache<T>;
+        Tile_Store(const Tile_Store&) = delete;
+        Tile_Store& operator=(const Tile_Store&) = delete;
+    public:
+        Tile_Store(const char *const filename, const unsigned int w, const unsigned int h,
+                   const unsigned int d=1, const unsigned int s=1,
+                   const unsigned int tile_width=256, const unsigned int tile_height=256):
+            _file(0), _width(w), _height(h), _depth(d), _spectrum(s),
+            _tile_width(tile_width), _tile_height(tile_height),
+            _nx(tile_width ? (w + tile_width - 1)/tile_width : 0), _ny(tile_height ? (h + tile_height - 1)/tile_height : 0),
+            _is_temporary(!filename)
+        {
+            if (!w || !h || !d || !s || !tile_width || !tile_height) {
+                throw "invalid size";
+            }
+            if (filename) _filename = filename;
+            else _filename = std::string(cimg::temporary_path()) + cimg_file_separator + cimg::filenamerand() + ".tiles";
+            _file = std::fopen(_filename.c_str(), "w+b");
+            if (!_file) {
+                throw "unable to open file";
+            }
+            // Extend the file to its full size, leaving it sparse.
+            if (cimg::fseek(_file, (cimg_long)(nb_tiles()*tile_size()*sizeof(T)) - 1, SEEK_SET) ||
+                std::fputc(0, _file) == EOF) {
+                std::fclose(_file);
+                std::remove(_filename.c_str());
+                throw "unable to create file";
+            }
+        }
+
+        ~Tile_Store() {
+            if (!_is_temporary) flush();
+            Tile_Cache<T>::instance().flush(this, true);
+            std::fclose(_file);
+            if (_is_temporary) std::remove(_filename.c_str());
+        }
+
+        unsigned int width() const { return _width; }
+        unsigned int height() const { return _height; }
+        unsigned int depth() const { return _depth; }
+        unsigned int spectrum() const { return _spectrum; }
+        unsigned int tile_width() const { return _tile_width; }
+        unsigned int tile_height() const { return _tile_height; }
+        const char* filename() const { return _filename.c_str(); }
+
+        std::size_t nb_tiles() const { return (std::size_t)_nx*_ny*_depth*_spectrum; }
+        std::size_t tile_size() const { return (std::size_t)_tile_width*_tile_height; }
+
+        // Tile (tx,ty) of plane (z,c), read-only or to be modified
+        std::shared_ptr<const CImg<T> > tile(const unsigned int tx, const unsigned int ty,
+                                             const unsigned int z, const unsigned int c) {
+            return Tile_Cache<T>::instance().get(*this, _tile_index(tx, ty, z, c), false);
+        }
+
+        std::shared_ptr<CImg<T> > tile_for_write(const unsigned int tx, const unsigned int ty,
+                                                 const unsigned int z, const unsigned int c) {
+            return Tile_Cache<T>::instance().get(*this, _tile_index(tx, ty, z, c), true);
+        }
+
+        // Write the modified tiles back to the file.
+        void flush() {
+            Tile_Cache<T>::instance().flush(this);
+        }
+
+        // Region (x0,y0,z0,c0)-(x1,y1,z1,c1), coordinates being clamped to the image (as for Neumann boundaries)
+        CImg<T> get_crop(const int x0, const int y0, const int z0, const int c0,
+                         const int x1, const int y1, const int z1, const int c1) {
+            CImg<T> res(x1 - x0 + 1, y1 - y0 + 1, z1 - z0 + 1, c1 - c0 + 1);
+            const int
+                cx0 = std::max(x0, 0), cx1 = std::min(x1, (int)_width - 1),
+                cy0 = std::max(y0, 0), cy1 = std::min(y1, (int)_height - 1);
+            if (cx0 > cx1 || cy0 > cy1) {
+                throw "index out of range";
+            }
+            cimg_forZC(res, z, c) {
+                const unsigned int
+                    zs = (unsigned int)cimg::cut(z0 + z, 0, (int)_depth - 1),
+                    cs = (unsigned int)cimg::cut(c0 + c, 0, (int)_spectrum - 1);
+                for (unsigned int ty = cy0/_tile_height; ty <= cy1/_tile_height; ++ty) {
+                    for (unsigned int tx = cx0/_tile_width; tx <= cx1/_tile_width; ++tx) {
+                        const std::shared_ptr<const CImg<T> > t = tile(tx, ty, zs, cs);
+                        const int
+                            xa = std::max(cx0, (int)(tx*_tile_width)), xb = std::min(cx1, (int)((tx + 1)*_tile_width) - 1),
+                            ya = std::max(cy0, (int)(ty*_tile_height)), yb = std::min(cy1, (int)((ty + 1)*_tile_height) - 1);
+                        for (int y = ya; y <= yb; ++y) {
+                            std::memcpy(res.data(xa - x0, y - y0, z, c), t->data(xa - tx*_tile_width, y - ty*_tile_height),
+                                        (xb - xa + 1)*sizeof(T));
+                        }
+                    }
+                }
+                // Clamp the outer border.
+                for (int y = cy0; y <= cy1; ++y) {
+                    T *const ptr = res.data(0, y - y0, z, c);
+                    for (int x = x0; x < cx0; ++x) ptr[x - x0] = ptr[cx0 - x0];
+                    for (int x = cx1 + 1; x <= x1; ++x) ptr[x - x0] = ptr[cx1 - x0];
+                }
+                for (int y = y0; y < cy0; ++y) std::memcpy(res.data(0, y - y0, z, c), res.data(0, cy0 - y0, z, c), res._width*sizeof(T));
+                for (int y = cy1 + 1; y <= y1; ++y) std::memcpy(res.data(0, y - y0, z, c), res.data(0, cy1 - y0, z, c), res._width*sizeof(T));
+            }
+            return res;
+        }
+
+        // Write img at (x0,y0,z0,c0), clipped to the image.
+        void draw_image(const int x0, const int y0, const int z0, const int c0, const CImg<T>& img) {
+            const int
+                cx0 = std::max(x0, 0), cx1 = std::min(x0 + img.width(), (int)_width) - 1,
+                cy0 = std::max(y0, 0), cy1 = std::min(y0 + img.height(), (int)_height) - 1;
+            if (cx0 > cx1 || cy0 > cy1) return;
+            cimg_forZC(img, z, c) {
+                if (z0 + z < 0 || z0 + z >= (int)_depth || c0 + c < 0 || c0 + c >= (int)_spectrum) continue;
+                for (unsigned int ty = cy0/_tile_height; ty <= cy1/_tile_height; ++ty) {
+                    for (unsigned int tx = cx0/_tile_width; tx <= cx1/_tile_width; ++tx) {
+                        const std::shared_ptr<CImg<T> > t = tile_for_write(tx, ty, z0 + z, c0 + c);
+                        const int
+                            xa = std::max(cx0, (int)(tx*_tile_width)), xb = std::min(cx1, (int)((tx + 1)*_tile_width) - 1),
+                            ya = std::max(cy0, (int)(ty*_tile_height)), yb = std::min(cy1, (int)((ty + 1)*_tile_height) - 1);
+                        for (int y = ya; y <= yb; ++y) {
+                            std::memcpy(t->data(xa - tx*_tile_width, y - ty*_tile_height), img.data(xa - x0, y - y0, z, c),
+                                        (xb - xa + 1)*sizeof(T));
+                        }
+                    }
+                }
+            }
+        }
+
+        std::size_t _tile_index(const unsigned int tx, const unsigned int ty, const unsigned int z, const unsigned int c) const {
+            if (tx >= _nx || ty >= _ny || z >= _depth || c >= _spectrum) {
+                throw "index out of range";
+            }
+            return (((std::size_t)c*_depth + z)*_ny + ty)*_nx + tx;
+        }
+
+    private:
+        void _read(const std::size_t index, CImg<T>& tile) {
+            std::lock_guard<std::mutex> lock(_file_mutex);
+            cimg::fseek(_file, (cimg_long)(index*tile_size()*sizeof(T)), SEEK_SET);
+            if (std::fread(tile._data, sizeof(T), tile_size(), _file) != tile_size()) tile.fill(0);
+        }
+
+        void _write(const std::size_t index, const CImg<T>& tile) {
+            std::lock_guard<std::mutex> lock(_file_mutex);
+            cimg::fseek(_file, (cimg_long)(index*tile_size()*sizeof(T)), SEEK_SET);
+            cimg::fwrite(tile._data, tile_size(), _file);
+        }
+    };
+
+    // Image of size (w,h,d,s) of which only the non-empty tiles are stored
+    /*
+        The image is cut into tiles of (tile_width,tile_height) pixels over
+        its whole depth and spectrum. A tile is either absent (transparent),
+        opaque, or stored with an alpha plane (colors being premultiplied,
+        as in Layer<T>::set_alpha()). Copies share their tiles until one of
+        them modifies a tile.
+    */
+    template<typename T>
+    class Sparse_Image {
+        struct _Tile {
+            std::shared_ptr<CImg<T> > data, alpha;
+        };
+        std::vector<_Tile> _tiles;
+        unsigned int _width, _height, _depth, _spectrum, _tile_width, _tile_height, _nx, _ny;
+    public:
+        // Transparent image
+        Sparse_Image(const unsigned int w, const unsigned int h, const unsigned int d=1, const unsigned int s=1,
+                     const unsigned int tile_width=64, const unsigned int tile_height=64):
+            _width(w), _height(h), _depth(d), _spectrum(s), _tile_width(tile_width), _tile_height(tile_height),
+            _nx(tile_width ? (w + tile_width - 1)/tile_width : 0), _ny(tile_height ? (h + tile_height - 1)/tile_height : 0)
+        {
+            if (!w || !h || !d || !s || !tile_width || !tile_height) {
+                throw "invalid size";
+            }
+            _tiles.resize((std::size_t)_nx*_ny);
+        }
+
+        // Opaque tiles of img, the tiles that are zero everywhere being left out
+        Sparse_Image(const CImg<T>& img, const unsigned int tile_width=64, const unsigned int tile_height=64):
+            Sparse_Image(img._width, img._height, img._depth, img._spectrum, tile_width, tile_height)
+        {
+            for (unsigned int ty = 0; ty < _ny; ++ty) for (unsigned int tx = 0; tx < _nx; ++tx) {
+                const int x0 = tx*_tile_width, y0 = ty*_tile_height;
+                if (_is_zero(img, x0, y0)) continue;
+                _tiles[ty*_nx + tx].data = std::make_shared<CImg<T> >(
+                    img.get_crop(x0, y0, 0, 0, x0 + _tile_width - 1, y0 + _tile_height - 1, _depth - 1, _spectrum - 1, 0));
+            }
+        }
+
+        // Tiles of img with alpha (not premultiplied), the fully transparent ones being left out
+        Sparse_Image(const CImg<T>& img, const CImg<T>& alpha, const unsigned int tile_width=64,
+                     const unsigned int tile_height=64):
+            Sparse_Image(img._width, img._height, img._depth, img._spectrum, tile_width, tile_height)
+        {
+            if (!alpha.is_sameXYZ(img) || alpha._spectrum != 1) {
+                throw "invalid alpha";
+            }
+            const float white = _white<T>();
+            for (unsigned int ty = 0; ty < _ny; ++ty) for (unsigned int tx = 0; tx < _nx; ++tx) {
+                const int x0 = tx*_tile_width, y0 = ty*_tile_height, x1 = x0 + _tile_width - 1, y1 = y0 + _tile_height - 1;
+                if (_is_zero(alpha, x0, y0)) continue;
+                _Tile& tile = _tiles[ty*_nx + tx];
+                tile.data = std::make_shared<CImg<T> >(img.get_crop(x0, y0, 0, 0, x1, y1, _depth - 1, _spectrum - 1, 0));
+                const CImg<T> a = alpha.get_crop(x0, y0, 0, 0, x1, y1, _depth - 1, 0, 0);
+                _premultiply(*tile.data, a);
+                bool is_opaque = true;
+                for (int z = 0; z < (int)_depth && is_opaque; ++z) {
+                    for (int y = y0; y <= std::min(y1, (int)_height - 1) && is_opaque; ++y) {
+                        for (int x = x0; x <= std::min(x1, (int)_width - 1) && is_opaque; ++x) {
+                            is_opaque = alpha(x, y, z) >= white;
+                        }
+                    }
+                }
+                if (!is_opaque) tile.alpha = std::make_shared<CImg<T> >(a);
+            }
+        }
+
+        unsigned int width() const { return _width; }
+        unsigned int height() const { return _height; }
+        unsigned int depth() const { return _depth; }
+        unsigned int spectrum() const { return _spectrum; }
+        unsigned int tile_width() const { return _tile_width; }
+        unsigned int tile_height() const { return _tile_height; }
+
+        std::size_t nb_tiles() const { return _tiles.size(); }
+
+        // Number of tiles stored, and memory they use (in bytes)
+        std::size_t nb_stored() const {
+            std::size_t res = 0;
+            for (std::size_t i = 0; i < _tiles.size(); ++i) res += _tiles[i].data != nullptr;
+            return res;
+        }
+
+        std::size_t size() const {
+            std::size_t res = 0;
+            for (std::size_t i = 0; i < _tiles.size(); ++i) {
+                if (_tiles[i].data) res += _tiles[i].data->size()*sizeof(T);
+                if (_tiles[i].alpha) res += _tiles[i].alpha->size()*sizeof(T);
+            }
+            return res;
+        }
+
+        // Colors and alpha plane of tile (tx,ty), 0 if the tile is absent (or opaque for the alpha)
+        const CImg<T>* tile(const unsigned int tx, const unsigned int ty) const {
+            return _tiles[_tile_index(tx, ty)].data.get();
+        }
+
+        const CImg<T>* alpha_tile(const unsigned int tx, const unsigned int ty) const {
+            return _tiles[_tile_index(tx, ty)].alpha.get();
+        }
+
+        // Colors of tile (tx,ty) to be modified, an absent tile being added transparent
+        CImg<T>& tile_for_write(const unsigned int tx, const unsigned int ty) {
+            _Tile& tile = _tiles[_tile_index(tx, ty)];
+            if (!tile.data) {
+                tile.data = std::make_shared<CImg<T> >(_tile_width, _tile_height, _depth, _spectrum, 0);
+                tile.alpha = std::make_shared<CImg<T> >(_tile_width, _tile_height, _depth, 1, 0);
+            } else if (tile.data.use_count() > 1) tile.data = std::make_shared<CImg<T> >(*tile.data);
+            return *tile.data;
+        }
+
+        // Draw sprite at (x0,y0) with opacity, as CImg<T>::draw_image() (the drawn pixels become opaque).
+        void draw_image(const int x0, const int y0, const CImg<T>& sprite, const float opacity=1) {
+            const int
+                cx0 = std::max(x0, 0), cx1 = std::min(x0 + sprite.width(), (int)_width) - 1,
+                cy0 = std::max(y0, 0), cy1 = std::min(y0 + sprite.height(), (int)_height) - 1;
+            if (cx0 > cx1 || cy0 > cy1) return;
+            const T white = (T)_white<T>();
+            for (unsigned int ty = cy0/_tile_height; ty <= cy1/_tile_height; ++ty) {
+                for (unsigned int tx = cx0/_tile_width; tx <= cx1/_tile_width; ++tx) {
+                    const int xt = tx*_tile_width, yt = ty*_tile_height;
+                    tile_for_write(tx, ty).draw_image(x0 - xt, y0 - yt, sprite, opacity);
+                    _Tile& tile = _tiles[ty*_nx + tx];
+                    if (!tile.alpha) continue;
+                    if (tile.alpha.use_count() > 1) tile.alpha = std::make_shared<CImg<T> >(*tile.alpha);
+                    tile.alpha->draw_rectangle(std::max(cx0, xt) - xt, std::max(cy0, yt) - yt, 0, 0,
+                                               std::min(cx1 - xt, (int)_tile_width - 1),
+                                               std::min(cy1 - yt, (int)_tile_height - 1), sprite.depth() - 1, 0,
+                                               white, opacity);
+                }
+            }
+        }
+
+        // Dense colors (premultiplied) and alpha plane
+        CImg<T> get_image() const {
+            CImg<T> res(_width, _height, _depth, _spectrum, 0);
+            for (unsigned int ty = 0; ty < _ny; ++ty) for (unsigned int tx = 0; tx < _nx; ++tx) {
+                const CImg<T> *const t = tile(tx, ty);
+                if (t) res.draw_image(tx*_tile_width, ty*_tile_height, *t);
+            }
+            return res;
+        }
+
+        CImg<T> get_alpha() const {
+            CImg<T> res(_width, _height, _depth, 1, 0);
+            for (unsigned int ty = 0; ty < _ny; ++ty) for (unsigned int tx = 0; tx < _nx; ++tx) {
+                const int x0 = tx*_tile_width, y0 = ty*_tile_height;
+                if (alpha_tile(tx, ty)) res.draw_image(x0, y0, *alpha_tile(tx, ty));
+                else if (tile(tx, ty)) {
+                    res.draw_rectangle(x0, y0, 0, 0, x0 + _tile_width - 1, y0 + _tile_height - 1, _depth - 1, 0,
+                                       (T)_white<T>());
+                }
+            }
+            return res;
+        }
+
+    private:
+        std::size_t _tile_index(const unsigned int tx, const unsigned int ty) const {
+            if (tx >= _nx || ty >= _ny) {
+                throw "index out of range";
+            }
+            return (std::size_t)ty*_nx + tx;
+        }
+
+        // Tell if the tile at (x0,y0) of img is zero everywhere.
+        bool _is_zero(const CImg<T>& img, const int x0, const int y0) const {
+            const int x1 = std::min(x0 + (int)_tile_width, img.width()), y1 = std::min(y0 + (int)_tile_height, img.height());
+            cimg_forZC(img, z, c) for (int y = y0; y < y1; ++y) {
+                const T *const ptr = img.data(0, y, z, c);
+                for (int x = x0; x < x1; ++x) if (ptr[x] != 0) return false;
+            }
+            return true;
+        }
+    };
+
+    // Image kept compressed in memory
+    /*
+        Byte planes of the pixel values (all the first bytes, then all the
+        second bytes...) are compressed with a byte-oriented LZ77 codec in
+        the LZ4 style: no entropy coding, so both ways run at memory-like
+        speed. Smooth or empty images compress well, noise does not.
+    */
+    template<typename T>
+    class Compressed_Image {
+        std::vector<unsigned char> _bytes;
+        unsigned int _width, _height, _depth, _spectrum;
+    public:
+        explicit Compressed_Image(const CImg<T>& img):
+            _width(img._width), _height(img._height), _depth(img._depth), _spectrum(img._spectrum)
+        {
+            const std::size_t n = img.size(), nb_bytes = n*sizeof(T);
+            const unsigned char *const ptrs = (const unsigned char*)img._data;
+            if (sizeof(T) == 1) {
+                _compress(ptrs, nb_bytes, _bytes);
+                return;
+            }
+            std::vector<unsigned char> planes(nb_bytes);
+            for (std::size_t b = 0; b < sizeof(T); ++b) {
+                unsigned char *const ptrd = planes.data() + b*n;
+                for (std::size_t i = 0; i < n; ++i) ptrd[i] = ptrs[i*sizeof(T) + b];
+            }
+            _compress(planes.data(), nb_bytes, _bytes);
+        }
+
+        unsigned int width() const { return _width; }
+        unsigned int height() const { return _height; }
+        unsigned int depth() const { return _depth; }
+        unsigned int spectrum() const { return _spectrum; }
+
+        // Size of the compressed data, and of the image (in bytes)
+        std::size_t size() const { return _bytes.size(); }
+        std::size_t raw_size() const { return (std::size_t)_width*_height*_depth*_spectrum*sizeof(T); }
+
+        // Decompress into the width()*height()*depth()*spectrum() values at ptrd.
+        void decompress(T *const ptrd) const {
+            const std::size_t n = raw_size()/sizeof(T);
+            unsigned char *const bytes = (unsigned char*)ptrd;
+            if (sizeof(T) == 1) {
+                _decompress(_bytes.data(), _bytes.size(), bytes, n);
+                return;
+            }
+            std::vector<unsigned char> planes(raw_size());
+            _decompress(_bytes.data(), _bytes.size(), planes.data(), planes.size());
+            for (std::size_t b = 0; b < sizeof(T); ++b) {
+                const unsigned char *const ptrs = planes.data() + b*n;
+                for (std::size_t i = 0; i < n; ++i) bytes[i*sizeof(T) + b] = ptrs[i];
+            }
+        }
+
+        CImg<T> get_image() const {
+            CImg<T> res(_width, _height, _depth, _spectrum);
+            decompress(res._data);
+            return res;
+        }
+
+    private:
+        // Sequences are: token (literal count << 4 | match length - 4), literals, match offset (16 bits),
+        // counts of 15 or more being continued by bytes of 255 and a last byte.
+        static void _put_count(std::vector<unsigned char>& out, std::size_t count) {
+            for ( ; count >= 255; count -= 255) out.push_back(255);
+            out.push_back((unsigned char)count);
+        }
+
+        static std::size_t _get_count(const unsigned char *&ptr) {
+            std::size_t res = 0;
+            unsigned char value;
+            do { value = *(ptr++); res += value; } while (value == 255);
+            return res;
+        }
+
+        static unsigned int _read32(const unsigned char *const ptr) {
+            unsigned int res;
+            std::memcpy(&res, ptr, 4);
+            return res;
+        }
+
+        static void _put_sequence(std::vector<unsigned char>& out, const unsigned char *const literals,
+                                  const std::size_t nb_literals, const std::size_t offset, const std::size_t length) {
+            const std::size_t match = length ? length - 4 : 0;
+            out.push_back((unsigned char)((std::min(nb_literals, (std::size_t)15) << 4) | std::min(match, (std::size_t)15)));
+            if (nb_literals >= 15) _put_count(out, nb_literals - 15);
+            out.insert(out.end(), literals, literals + nb_literals);
+            if (!length) return;
+            out.push_back((unsigned char)(offset & 255));
+            out.push_back((unsigned char)(offset >> 8));
+            if (match >= 15) _put_count(out, match - 15);
+        }
+
+        static void _compress(const unsigned char *const src, const std::size_t n, std::vector<unsigned char>& out) {
+            out.clear();
+            out.reserve(n/2 + 16);
+            std::vector<std::size_t> table(1 << 16, 0);
+            std::size_t anchor = 0, i = 0;
+            // The last 12 bytes are never the start of a match, nor the last 5 its end.
+            while (n > 12 && i < n - 12) {
+                const unsigned int seq = _read32(src + i), h = (seq*2654435761U) >> 16;
+                const std::size_t ref = table[h];
+                table[h] = i;
+                if (ref < i && i - ref < 65536 && _read32(src + ref) == seq) {
+                    std::size_t length = 4;
+                    while (i + length < n - 5 && src[ref + length] == src[i + length]) ++length;
+                    _put_sequence(out, src + anchor, i - anchor, i - ref, length);
+                    i += length;
+                    anchor = i;
+                } else i += 1 + ((i - anchor) >> 6);   // faster through incompressible data
+            }
+            _put_sequence(out, src + anchor, n - anchor, 0, 0);
+        }
+
+        static void _decompress(const unsigned char *ptrs, const std::size_t n, unsigned char *ptrd, const std::size_t size) {
+            const unsigned char *const ptrs_end = ptrs + n, *const ptrd_end = ptrd + size;
+            while (ptrs < ptrs_end) {
+                const unsigned int token = *(ptrs++);
+                std::size_t nb_literals = token >> 4;
+                if (nb_literals == 15) nb_literals += _get_count(ptrs);
+                if (ptrd + nb_literals > ptrd_end) {
+                    throw "corrupted data";
+                }
+                std::memcpy(ptrd, ptrs, nb_literals);
+                ptrs += nb_literals;
+                ptrd += nb_literals;
+                if (ptrs >= ptrs_end) break;
+                const std::size_t offset = ptrs[0] | (ptrs[1] << 8);
+                ptrs += 2;
+                std::size_t length = token & 15;
+                if (length == 15) length += _get_count(ptrs);
+                length += 4;
+                if (ptrd + length > ptrd_end) {
+                    throw "corrupted data";
+                }
+                // A match overlapping what it copies repeats its first offset bytes,
+                // so copies can double in size.
+                const unsigned char *const ptrm = ptrd - offset;
+                while (length) {
+                    const std::size_t nb = std::min(length, (std::size_t)(ptrd - ptrm));
+                    std::memcpy(ptrd, ptrm, nb);
+                    ptrd += nb;
+                    length -= nb;
+                }
+            }
+        }
+    };
+
+    template<typename T>
+    class Layer {
+        mutable std::shared_ptr<CImg<T> > _data, _alpha;
+        mutable std::shared_ptr<const Compressed_Image<T> > _packed, _packed_alpha;
+        struct _Narrow {
+            CImg<unsigned short> data, alpha;
+            Storage_Format format;
+        };
+        mutable std::shared_ptr<const _Narrow> _narrow;
+        struct _Smoothing {
+            std::mutex mutex;
+            unsigned long revision;
+            int index;
+            CImg<T> iterate;
+        };
+        mutable std::shared_ptr<_Smoothing> _smoothing;
+        std::shared_ptr<Tile_Store<T> > _tiles;
+        std::shared_ptr<Sparse_Image<T> > _sparse;
+        bool _is_mapped;
+        mutable unsigned long _used;
+        bool _is_visible;
+        float _opacity;
+        Blend_Mode _blend_mode;
+        unsigned long _revision;
+        int _x, _y, _z;
+
+        template<typename, std::size_t> friend class Layer_System;
+    public:
+
+        //  Default deconstructor
+        ~Layer() {}
+
+        // type definitions
+        typedef CImg<T>              value_type;
+        typedef CImg<T>*             iterator;
+        typedef const CImg<T>*       const_iterator;
+        typedef CImg<T>&             reference;
+        typedef const CImg<T>&       const_reference;
+        typedef std::size_t          size_type;
+
+        //  Default constructor
+        /**
+         * Construct a new empty layer instance
+        **/
+        Layer(): _is_mapped(false), _used(0), _is_visible(true), _opacity(1), _blend_mode(blend_normal),
+            _revision(_new_revision()), _x(0), _y(0), _z(0){}
+
+        //  Construct layer of specific image
+        /**
+         * \param img CImg instance
+        **/
+        Layer(const CImg<T>& img) {
+            _data = _copy(img);
+            _is_mapped = false;
+            _used = 0;
+            _is_visible = true;
+            _opacity = 1;
+            _blend_mode = blend_normal;
+            _revision = _new_revision();
+            _x = _y = _z = 0;
+        }
+
+        //  Construct layer of an image, taking its pixels without copying them
+        Layer(CImg<T>&& img): _is_mapped(false), _used(0), _is_visible(true), _opacity(1), _blend_mode(blend_normal),
+            _revision(_new_revision()), _x(0), _y(0), _z(0)
+        {
+            _data = _new_data(std::move(img));
+        }
+
+        Layer(const CImg<T> &img, const bool is_visible): _is_mapped(false), _used(0), _is_visible(true), _opacity(1), _blend_mode(blend_normal),
+            _revision(_new_revision()), _x(0), _y(0), _z(0)
+        {
+            _data = _copy(img);
+            _is_visible = is_visible;
+        }
+
+        //  Construct layer of an image with alpha (see set_alpha())
+        /**
+         * \param img CImg instance, not premultiplied
+         * \param alpha CImg instance with the size of img and one channel
+        **/
+        Layer(const CImg<T>& img, const CImg<T>& alpha): _is_mapped(false), _used(0), _is_visible(true),
+            _opacity(1), _blend_mode(blend_normal), _revision(_new_revision()), _x(0), _y(0), _z(0)
+        {
+            _data = _copy(img);
+            set_alpha(alpha);
+        }
+
+        // Copy and move
+        /*
+            Copies share the pixels of the layer (see data()), moves take them.
+        */
+        Layer(const Layer& layer) = default;
+        Layer(Layer&& layer) = default;
+        Layer& operator=(const Layer& layer) = default;
+        Layer& operator=(Layer&& layer) = default;
+
+        // Visibility
+        bool visible() const {
+            return _is_visible;
+        }
+
+        void set_visible() {
+            if (!_is_visible) _touch();
+            _is_visible = true;
+        }
+
+        void set_invisible() {
+            if (_is_visible) _touch();
+            _is_visible = false;
+        }
+
+        // Revision
+        /*
+            Stamp of the layer content, renewed whenever the layer changes.
+            Copies of a layer share its revision.
+        */
+        unsigned long revision() const {
+            return _revision;
+        }
+
+        static unsigned long _new_revision() {
+            static std::atomic<unsigned long> counter(0);
+            return ++counter;
+        }
+
+        void _touch() {
+            _revision = _new_revision();
+        }
+
+        // Opacity
+        /*
+            Clamped to [0,1], merge_layer() blends the layer as
+            opacity*layer + (1 - opacity)*below.
+        */
+        float opacity() const {
+            return _opacity;
+        }
+
+        void set_opacity(const float opacity) {
+            const float value = opacity < 0 ? 0 : opacity > 1 ? 1 : opacity;
+            if (value != _opacity) _touch();
+            _opacity = value;
+        }
+
+        // Tell if the layer hides what is below it when merged.
+        bool _is_opaque() const {
+            return _is_visible && _has_pixels() && !has_alpha() && _opacity >= 1 && _blend_mode == blend_normal;
+        }
+
+        bool _has_pixels() const {
+            return _data || _packed || _narrow || _tiles || _sparse;
+        }
+
+        // Alpha
+        /*
+            Optional alpha plane with the size of the layer, from 0 (transparent)
+            to white (opaque, 255 for floating-point images). Colors are then
+            stored premultiplied by alpha/white, data() returns them so.
+            merge_layer() skips transparent runs, copies opaque ones and only
+            blends the partially transparent pixels. A bottom layer with alpha
+            is merged as if over black.
+        */
+        bool has_alpha() const {
+            return _alpha || _packed_alpha || (_narrow && _narrow->alpha) || _sparse;
+        }
+
+        CImg<T> alpha() const {
+            _unpack();
+            if (_narrow) return _narrow->alpha ? _get_widened(_narrow->alpha) : CImg<T>();
+            return _sparse ? _sparse->get_alpha() : _alpha ? *_alpha : CImg<T>();
+        }
+
+        // Set the alpha plane and premultiply the colors (after unpremultiplying them by the previous alpha).
+        void set_alpha(const CImg<T>& alpha) {
+            _unpack();
+            _widen();
+            if (!_data || alpha.width() != _data->width() || alpha.height() != _data->height() ||
+                alpha.depth() != _data->depth() || alpha.spectrum() != 1) throw "invalid alpha";
+            const std::shared_ptr<CImg<T> > res = _copy(*_data);
+            if (_alpha) _unpremultiply(*res, *_alpha);
+            _premultiply(*res, alpha);
+            _set_data(res);
+            _alpha = _copy(alpha);
+            _touch();
+        }
+
+        // Blend mode
+        Blend_Mode blend_mode() const {
+            return _blend_mode;
+        }
+
+        void set_blend_mode(const Blend_Mode mode) {
+            if (mode != _blend_mode) _touch();
+            _blend_mode = mode;
+        }
+
+        // Position
+        /*
+            Offset of the layer in the canvas, i.e. in the bottom layer of a
+            Layer_System (whose own position is ignored). Only the bounding
+            box of the layer is blended by merge_layer().
+        */
+        int x() const { return _x; }
+        int y() const { return _y; }
+        int z() const { return _z; }
+
+        void set_position(const int x0, const int y0, const int z0=0) {
+            if (x0 != _x || y0 != _y || z0 != _z) _touch();
+            _x = x0;
+            _y = y0;
+            _z = z0;
+        }
+
+        // Size of the layer image
+        int width() const {
+            return _tiles ? (int)_tiles->width() : _sparse ? (int)_sparse->width() : _data ? _data->width() :
+                _packed ? (int)_packed->width() : _narrow ? _narrow->data.width() : 0;
+        }
+        int height() const {
+            return _tiles ? (int)_tiles->height() : _sparse ? (int)_sparse->height() : _data ? _data->height() :
+                _packed ? (int)_packed->height() : _narrow ? _narrow->data.height() : 0;
+        }
+        int depth() const {
+            return _tiles ? (int)_tiles->depth() : _sparse ? (int)_sparse->depth() : _data ? _data->depth() :
+                _packed ? (int)_packed->depth() : _narrow ? _narrow->data.depth() : 0;
+        }
+        int spectrum() const {
+            return _tiles ? (int)_tiles->spectrum() : _sparse ? (int)_sparse->spectrum() : _data ? _data->spectrum() :
+                _packed ? (int)_packed->spectrum() : _narrow ? _narrow->data.spectrum() : 0;
+        }
+
+        // Display the layer (tiled layers are subsampled to at most 1024x1024)
+        void display() {
+            if (_tiles) get_preview(1024).display();
+            else if (_sparse || _narrow) get_image().display();
+            else data().display();
+        }
+
+        // Data
+        /*
+            Copies of a layer share their pixels, which are only copied when
+            one of them is modified (copy-on-write). data() gives read-only
+            access without copying, mutable_data() makes the pixels of this
+            layer unshared first.
+        */
+        const CImg<T>& data() const {
+            static const CImg<T> empty;
+            if (_tiles) {
+                throw "tiled layer";
+            }
+            if (_sparse) {
+                throw "sparse layer";
+            }
+            _unpack();
+            _widen();
+            return _data ? *_data : empty;
+        }
+
+        CImg<T>& mutable_data() {
+            if (_tiles) {
+                throw "tiled layer";
+            }
+            if (_sparse) {
+                throw "sparse layer";
+            }
+            _unpack();
+            _widen();
+            if (!_data) _set_data(_new_data());
+            else if (_data.use_count() > 1) _set_data(_copy(*_data));
+            _touch();
+            return *_data;
+        }
+
+        // Number of pixel buffers copied by layers so far, and their total size (in bytes)
+        static unsigned long copy_count() {
+            return _copy_counter();
+        }
+
+        static unsigned long long copied_bytes() {
+            return _copied_bytes();
+        }
+
+        static std::atomic<unsigned long>& _copy_counter() {
+            static std::atomic<unsigned long> counter(0);
+            return counter;
+        }
+
+        static std::atomic<unsigned long long>& _copied_bytes() {
+            static std::atomic<unsigned long long> counter(0);
+            return counter;
+        }
+
+        // Replace the pixels by an owned buffer, which ends a memory mapping
+        void _set_data(const std::shared_ptr<CImg<T> >& data) {
+            _data = data;
+            _is_mapped = false;
+        }
+
+        static std::shared_ptr<CImg<T> > _copy(const CImg<T>& img) {
+            ++_copy_counter();
+            _copied_bytes() += img.size()*sizeof(T);
+            const std::shared_ptr<CImg<T> > res = _new_pooled(img._width, img._height, img._depth, img._spectrum);
+            if (!img.is_empty()) std::memcpy(res->_data, img._data, img.size()*sizeof(T));
+            return res;
+        }
+
+        // Pixel storage allocated and freed by layers so far (in bytes)
+        /*
+            A buffer is counted with its size when created, and freed when the
+            last layer sharing it is destroyed or replaces it.
+        */
+        static unsigned long long allocated_bytes() {
+            return _allocated_bytes();
+        }
+
+        static unsigned long long freed_bytes() {
+            return _freed_bytes();
+        }
+
+        static std::atomic<unsigned long long>& _allocated_bytes() {
+            static std::atomic<unsigned long long> counter(0);
+            return counter;
+        }
+
+        static std::atomic<unsigned long long>& _freed_bytes() {
+            static std::atomic<unsigned long long> counter(0);
+            return counter;
+        }
+
+        // New pixel storage, constructed from args (same arguments as a CImg<T> constructor)
+        template<typename... Args>
+        static std::shared_ptr<CImg<T> > _new_data(Args&&... args) {
+            return _own(new CImg<T>(std::forward<Args>(args)...), 0, 0);
+        }
+
+        // New pixel storage of size (w,h,d,s) from the pixel pool, not initialized
+        static std::shared_ptr<CImg<T> > _new_pooled(const unsigned int w, const unsigned int h,
+                                                     const unsigned int d, const unsigned int s) {
+            CImg<T> *const img = new CImg<T>();
+            const std::size_t n = (std::size_t)w*h*d*s;
+            if (!n) return _own(img, 0, 0);
+            std::size_t capacity = 0;
+            img->_data = Pixel_Pool<T>::instance().acquire(n, capacity);
+            img->_width = w;
+            img->_height = h;
+            img->_depth = d;
+            img->_spectrum = s;
+            return _own(img, img->_data, capacity);
+        }
+
+        // Count the storage, and give its buffer to the pixel pool when freed.
+        /*
+            buf and capacity describe the buffer acquired from the pool, if
+            the image still holds it when freed.
+        */
+        static std::shared_ptr<CImg<T> > _own(CImg<T> *const img, T *const buf, const std::size_t capacity) {
+            const unsigned long long bytes = img->size()*sizeof(T);
+            _allocated_bytes() += bytes;
+            return std::shared_ptr<CImg<T> >(img, [bytes, buf, capacity](CImg<T> *const ptr) {
+                _freed_bytes() += bytes;
+                if (ptr->_data && !ptr->_is_shared) {
+                    Pixel_Pool<T>::instance().release(ptr->_data, ptr->_data == buf ? capacity : ptr->size());
+                    ptr->_data = 0;
+                    ptr->_width = ptr->_height = ptr->_depth = ptr->_spectrum = 0;
+                }
+                delete ptr;
+            });
+        }
+
+        // Memory-mapped layers
+        /*
+            The pixels are the content of a file, mapped in memory and held as
+            a shared CImg<T>. The system pages them in on demand, so
+            merge_layer() only reads the parts of the file it composites,
+            and pages can be dropped again under memory pressure. With
+            is_writable, pixel changes are written to the file; otherwise they
+            stay in memory and the file is left untouched.
+            Mapped layers cannot be resized, and whatever copies their pixels
+            (mutable_data() on a shared layer, set_alpha(), smooth_layer(),
+            blur_gradient_layer()...) loads them all into a regular layer.
+            exposure_layer() on a moved float layer works in place.
+            POSIX systems only.
+        */
+        // Map w*h*d*s raw values of type T (CImg<T> layout), stored at offset in filename
+        static Layer map_raw(const char *const filename, const unsigned int w, const unsigned int h,
+                             const unsigned int d=1, const unsigned int s=1,
+                             const cimg_ulong offset=0, const bool is_writable=false) {
+            return _map(filename, w, h, d, s, offset, is_writable, false);
+        }
+
+        // Map the first image of a .cimg file, which must be uncompressed, of type T and native endianness
+        static Layer map_cimg(const char *const filename, const bool is_writable=false) {
+            std::FILE *const file = cimg::fopen(filename, "rb");
+            char type[256] = { 0 }, endian[256] = { 0 };
+            unsigned int nb = 0, w = 0, h = 0, d = 0, s = 0;
+            int c = 0;
+            const bool is_valid = std::fscanf(file, "%u %255s %255s", &nb, type, endian) == 3 &&
+                std::fscanf(file, "%u %u %u %u", &w, &h, &d, &s) == 4;
+            while (is_valid && (c = std::fgetc(file)) == ' ') {}
+            const cimg_ulong offset = (cimg_ulong)std::ftell(file);
+            cimg::fclose(file);
+            const char *const ptype = cimg::type<T>::string(), *const etype = cimg::endianness() ? "big" : "little";
+            const bool is_type = std::strstr(ptype, "unsigned") == ptype ?
+                !std::strncmp(type, "unsigned_", 9) && !std::strcmp(type + 9, ptype + 9) : !std::strcmp(type, ptype);
+            if (!is_valid || !nb || c != '\n' || !is_type || std::strncmp(endian, etype, std::strlen(etype))) {
+                throw "unsupported .cimg file";
+            }
+            return _map(filename, w, h, d, s, offset, is_writable, false);
+        }
+
+        // Create (or truncate) a raw file holding an image of size (w,h,d,s), and map it writable
+        static Layer create_raw(const char *const filename, const unsigned int w, const unsigned int h,
+                                const unsigned int d=1, const unsigned int s=1) {
+            return _map(filename, w, h, d, s, 0, true, true);
+        }
+
+        static Layer _map(const char *const filename, const unsigned int w, const unsigned int h,
+                          const unsigned int d, const unsigned int s, const cimg_ulong offset,
+                          const bool is_writable, const bool is_created) {
+#if cimg_OS==1
+            const cimg_ulong bytes = (cimg_ulong)w*h*d*s*sizeof(T);
+            if (!bytes) {
+                throw "invalid size";
+            }
+            const int fd = open(filename, is_created ? O_RDWR | O_CREAT | O_TRUNC : is_writable ? O_RDWR : O_RDONLY, 0644);
+            if (fd < 0) {
+                throw "unable to open file";
+            }
+            struct stat st;
+            if ((is_created && ftruncate(fd, (off_t)(offset + bytes))) ||
+                fstat(fd, &st) || (cimg_ulong)st.st_size < offset + bytes) {
+                close(fd);
+                throw "file too small";
+            }
+            const cimg_ulong page = (cimg_ulong)sysconf(_SC_PAGESIZE), start = offset/page*page;
+            const std::size_t length = (std::size_t)(offset + bytes - start);
+            void *const addr = mmap(0, length, PROT_READ | PROT_WRITE, is_writable ? MAP_SHARED : MAP_PRIVATE,
+                                    fd, (off_t)start);
+            close(fd);
+            if (addr == MAP_FAILED) {
+                throw "unable to map file";
+            }
+            Layer res;
+            res._is_mapped = true;
+            res._data = std::shared_ptr<CImg<T> >(new CImg<T>((T*)((char*)addr + offset - start), w, h, d, s, true),
+                                                  [addr, length](CImg<T> *const ptr) {
+                                                      delete ptr;
+                                                      munmap(addr, length);
+                                                  });
+            return res;
+#else
+            cimg::unused(filename, w, h, d, s, offset, is_writable, is_created);
+            throw "memory mapping not supported";
+#endif
+        }
+
+        // Tiled layers
+        /*
+            The pixels are kept in a Tile_Store<T> (a file cut into tiles), and
+            only the tiles in use are loaded, through Tile_Cache<T> and its
+            memory budget. merge_layer(), exposure_layer(),
+            blur_gradient_layer() and display() read them tile by tile, so
+            gigapixel layers are composited in bounded memory. data() and
+            mutable_data() throw for tiled layers, use tiles() or get_image()
+            instead. Copies of a tiled layer share its store.
+        */
+        // Empty (zero) tiled layer of size (w,h,d,s), stored in filename (a temporary file if 0)
+        static Layer tiled(const unsigned int w, const unsigned int h, const unsigned int d=1, const unsigned int s=1,
+                           const char *const filename=0, const unsigned int tile_width=256,
+                           const unsigned int tile_height=256) {
+            Layer res;
+            res._tiles = std::make_shared<Tile_Store<T> >(filename, w, h, d, s, tile_width, tile_height);
+            return res;
+        }
+
+        // Tiled layer holding img
+        static Layer tiled(const CImg<T>& img, const char *const filename=0, const unsigned int tile_width=256,
+                           const unsigned int tile_height=256) {
+            Layer res = tiled(img._width, img._height, img._depth, img._spectrum, filename, tile_width, tile_height);
+            res._tiles->draw_image(0, 0, 0, 0, img);
+            return res;
+        }
+
+        bool is_tiled() const {
+            return _tiles != nullptr;
+        }
+
+        Tile_Store<T>& tiles() const {
+            if (!_tiles) {
+                throw "not a tiled layer";
+            }
+            return *_tiles;
+        }
+
+        // Sparse layers
+        /*
+            Only the tiles holding non-transparent pixels are stored (see
+            Sparse_Image<T>), the others are transparent and skipped by
+            merge_layer() and composite(). Suits annotations, masks or text
+            drawn over a small part of the canvas. data() and mutable_data()
+            throw for sparse layers, use sparse_image() or get_image()
+            instead; draw_layer() adds tiles as needed.
+        */
+        // Transparent sparse layer of size (w,h,d,s)
+        static Layer sparse(const unsigned int w, const unsigned int h, const unsigned int d=1, const unsigned int s=1,
+                            const unsigned int tile_width=64, const unsigned int tile_height=64) {
+            Layer res;
+            res._sparse = std::make_shared<Sparse_Image<T> >(w, h, d, s, tile_width, tile_height);
+            return res;
+        }
+
+        // Sparse layer holding img, its tiles of zeros being transparent
+        static Layer sparse(const CImg<T>& img, const unsigned int tile_width=64, const unsigned int tile_height=64) {
+            Layer res;
+            res._sparse = std::make_shared<Sparse_Image<T> >(img, tile_width, tile_height);
+            return res;
+        }
+
+        // Sparse layer holding img with alpha (see set_alpha())
+        static Layer sparse(const CImg<T>& img, const CImg<T>& alpha, const unsigned int tile_width=64,
+                            const unsigned int tile_height=64) {
+            Layer res;
+            res._sparse = std::make_shared<Sparse_Image<T> >(img, alpha, tile_width, tile_height);
+            return res;
+        }
+
+        bool is_sparse() const {
+            return _sparse != nullptr;
+        }
+
+        const Sparse_Image<T>& sparse_image() const {
+            if (!_sparse) {
+                throw "not a sparse layer";
+            }
+            return *_sparse;
+        }
+
+        // Sparse image to be modified, copied first if shared with another layer
+        Sparse_Image<T>& mutable_sparse_image() {
+            if (!_sparse) {
+                throw "not a sparse layer";
+            }
+            if (_sparse.use_count() > 1) _sparse = std::make_shared<Sparse_Image<T> >(*_sparse);
+            _touch();
+            return *_sparse;
+        }
+
+        // Storage format
+        /*
+            Floating-point layers can keep their pixels (and alpha) as 16-bit
+            floats, IEEE half or bfloat16, which halves the memory of float
+            layers. Merges, exposure_layer() and blur_gradient_layer() read
+            them in short spans converted to T (with F16C instructions when
+            available), and the last two return layers in the same format.
+            data() and mutable_data() convert the layer back to
+            storage_native, as do mapped, tiled, sparse and compressed
+            layers, which always keep T.
+        */
+        void set_storage(const Storage_Format format) {
+            if (format == storage()) return;
+            if (!cimg::type<T>::is_float() || _is_mapped || _tiles || _sparse) {
+                throw "invalid storage";
+            }
+            _unpack();
+            _widen();
+            if (format == storage_native || !_data) return;
+            const std::shared_ptr<_Narrow> narrow = std::make_shared<_Narrow>();
+            narrow->format = format;
+            narrow->data.assign(_data->_width, _data->_height, _data->_depth, _data->_spectrum);
+            _narrow_span(narrow->data._data, _data->_data, _data->size(), format);
+            if (_alpha) {
+                narrow->alpha.assign(_alpha->_width, _alpha->_height, _alpha->_depth, 1);
+                _narrow_span(narrow->alpha._data, _alpha->_data, _alpha->size(), format);
+            }
+            _narrow = narrow;
+            _data.reset();
+            _alpha.reset();
+            _touch();
+        }
+
+        Storage_Format storage() const {
+            return _narrow ? _narrow->format : storage_native;
+        }
+
+        // Memory used by the pixels (and alpha) of the layer (in bytes, 0 for mapped, tiled and sparse layers)
+        std::size_t storage_size() const {
+            if (_narrow) return (_narrow->data.size() + _narrow->alpha.size())*sizeof(unsigned short);
+            if (_packed) return compressed_size();
+            if (!_data || _is_mapped) return 0;
+            return (_data->size() + (_alpha ? _alpha->size() : 0))*sizeof(T);
+        }
+
+        // Back to storage_native
+        void _widen() const {
+            if (!_narrow) return;
+            _data = _new_pooled(_narrow->data._width, _narrow->data._height, _narrow->data._depth, _narrow->data._spectrum);
+            _widen_span(_data->_data, _narrow->data._data, _data->size(), _narrow->format);
+            if (_narrow->alpha) {
+                _alpha = _new_pooled(_narrow->alpha._width, _narrow->alpha._height, _narrow->alpha._depth, 1);
+                _widen_span(_alpha->_data, _narrow->alpha._data, _alpha->size(), _narrow->format);
+            }
+            _narrow.reset();
+        }
+
+        CImg<T> _get_widened(const CImg<unsigned short>& img) const {
+            CImg<T> res(img._width, img._height, img._depth, img._spectrum);
+            _widen_span(res._data, img._data, img.size(), _narrow->format);
+            return res;
+        }
+
+        // Compression
+        /*
+            compress() keeps the pixels (and alpha) of the layer compressed
+            in memory (see Compressed_Image<T>), they are decompressed the
+            next time they are needed, by data() or a merge. The revision is
+            unchanged, so compositing does not redo the layer. Mapped,
+            tiled and sparse layers are left as they are. Decompressing
+            from data() is not thread-safe.
+        */
+        void compress() {
+            if (!_data || _is_mapped) return;
+            _packed = std::make_shared<Compressed_Image<T> >(*_data);
+            if (_alpha) _packed_alpha = std::make_shared<Compressed_Image<T> >(*_alpha);
+            _data.reset();
+            _alpha.reset();
+            ++_compress_counter();
+        }
+
+        void decompress() const {
+            _unpack();
+        }
+
+        bool is_compressed() const {
+            return _packed != nullptr;
+        }
+
+        // Memory used by the compressed pixels (in bytes)
+        std::size_t compressed_size() const {
+            return (_packed ? _packed->size() : 0) + (_packed_alpha ? _packed_alpha->size() : 0);
+        }
+
+        // Number of layer compressions and decompressions so far
+        static unsigned long compress_count() {
+            return _compress_counter();
+        }
+
+        static unsigned long decompress_count() {
+            return _decompress_counter();
+        }
+
+        static std::atomic<unsigned long>& _compress_counter() {
+            static std::atomic<unsigned long> counter(0);
+            return counter;
+        }
+
+        static std::atomic<unsigned long>& _decompress_counter() {
+            static std::atomic<unsigned long> counter(0);
+            return counter;
+        }
+
+        void _unpack() const {
+            _used = _new_use();
+            if (!_packed) return;
+            _data = _new_pooled(_packed->width(), _packed->height(), _packed->depth(), _packed->spectrum());
+            _packed->decompress(_data->_data);
+            if (_packed_alpha) {
+                _alpha = _new_pooled(_packed_alpha->width(), _packed_alpha->height(), _packed_alpha->depth(), 1);
+                _packed_alpha->decompress(_alpha->_data);
+            }
+            _packed.reset();
+            _packed_alpha.reset();
+            ++_decompress_counter();
+        }
+
+        // Stamp of the last use of the pixels, for least-recently-used policies
+        static unsigned long _new_use() {
+            static std::atomic<unsigned long> counter(0);
+            return ++counter;
+        }
+
+        // Whole image of the layer (loads every tile of a tiled layer, colors of a sparse layer are premultiplied)
+        CImg<T> get_image() const {
+            if (_narrow) return _get_widened(_narrow->data);
+            if (_sparse) return _sparse->get_image();
+            if (!_tiles) return data();
+            return _tiles->get_crop(0, 0, 0, 0, width() - 1, height() - 1, depth() - 1, spectrum() - 1);
+        }
+
+        // Image smoothed to iteration index of iter (see CImg<T>::get_smooth())
+        /*
+            The layer keeps the last iterate it computed and continues from
+            it when a later index is asked for, so moving a smoothing slider
+            forward by one step costs one iteration. An earlier index restarts
+            from the image. The iterate is kept until the layer changes (see
+            revision()) or clear_smooth() is called. Copies of the layer share it.
+            The kept iterate is replaced with atomic operations and stepped
+            under its own mutex. With alpha, the unpremultiplied colors are
+            smoothed, and returned premultiplied like data().
+        */
+        CImg<T> get_smooth(const int index, const int iter=50) const {
+            if (_tiles) {
+                throw "tiled layer";
+            }
+            if (index <= 0 || index >= iter) return get_image();
+            const CImg<T> alpha = this->alpha();
+            std::shared_ptr<_Smoothing> state = std::atomic_load(&_smoothing);
+            if (!state || state->revision != _revision) {
+                state = std::make_shared<_Smoothing>();
+                state->revision = _revision;
+                state->index = 0;
+                std::atomic_store(&_smoothing, state);
+            }
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (!state->index || state->index > index) {
+                CImg<T> img = get_image();
+                if (!alpha.is_empty()) _unpremultiply(img, alpha);
+                img.move_to(state->iterate);
+                state->index = 0;
+            }
+            state->iterate.smooth_iterate(index - state->index);
+            state->index = index;
+            CImg<T> res(state->iterate);
+            if (!alpha.is_empty()) _premultiply(res, alpha);
+            return res;
+        }
+
+        // Free the iterate kept by get_smooth()
+        void clear_smooth() {
+            std::atomic_store(&_smoothing, std::shared_ptr<_Smoothing>());
+        }
+
+        // Smoothing iteration kept by get_smooth() (0 if none)
+        int smooth_index() const {
+            const std::shared_ptr<_Smoothing> state = std::atomic_load(&_smoothing);
+            return state && state->revision == _revision ? state->index : 0;
+        }
+
+        // Layer subsampled to at most size x size pixels, reading one tile at a time
+        CImg<T> get_preview(const unsigned int size) const {
+            const int w = width(), h = height();
+            if (!w || !h) return CImg<T>();
+            const int factor = std::max(1, (int)std::max((w + size - 1)/size, (h + size - 1)/size));
+            if (_sparse) return _sparse->get_image().resize(-100/factor, -100/factor, -100, -100, 1);
+            if (_narrow) return get_image().resize(-100/factor, -100/factor, -100, -100, 1);
+            if (!_tiles) return factor == 1 ? +data() : data().get_resize(-100/factor, -100/factor, -100, -100, 1);
+            const Tile_Store<T>& store = *_tiles;
+            const int tw = store.tile_width(), th = store.tile_height();
+            CImg<T> res((w + factor - 1)/factor, (h + factor - 1)/factor, depth(), spectrum());
+            cimg_forZC(res, z, c) {
+                for (int ty = 0; ty*th < h; ++ty) for (int tx = 0; tx*tw < w; ++tx) {
+                    const std::shared_ptr<const CImg<T> > t = _tiles->tile(tx, ty, z, c);
+                    for (int y = (ty*th + factor - 1)/factor*factor; y < std::min(h, (ty + 1)*th); y += factor) {
+                        for (int x = (tx*tw + factor - 1)/factor*factor; x < std::min(w, (tx + 1)*tw); x += factor) {
+                            res(x/factor, y/factor, z, c) = (*t)(x - tx*tw, y - ty*th);
+                        }
+                    }
+                }
+            }
+            return res;
+        }
+
+        // Clear
+        Layer& clear() {
+            _data = _new_data();
+            _alpha.reset();
+            _packed.reset();
+            _packed_alpha.reset();
+            _narrow.reset();
+            _smoothing.reset();
+            _tiles.reset();
+            _sparse.reset();
+            _is_mapped = false;
+            _is_visible = true;
+            _opacity = 1;
+            _blend_mode = blend_normal;
+            _x = _y = _z = 0;
+            _touch();
+            return *this;
+        }
+
+    };
+
+    // Rectangle (x0,y0)-(x1,y1) of a layer system canvas, bounds included
+    struct Rect {
+        int x0, y0, x1, y1;
+
+        Rect(): x0(0), y0(0), x1(-1), y1(-1) {}
+        Rect(const int X0, const int Y0, const int X1, const int Y1): x0(X0), y0(Y0), x1(X1), y1(Y1) {}
+
+        bool is_empty() const { return x1 < x0 || y1 < y0; }
+
+        bool intersects(const Rect& r) const {
+            return !is_empty() && !r.is_empty() && x0 <= r.x1 && r.x0 <= x1 && y0 <= r.y1 && r.y0 <= y1;
+        }
+
+        Rect get_union(const Rect& r) const {
+            if (is_empty()) return r;
+            if (r.is_empty()) return *this;
+            return Rect(std::min(x0, r.x0), std::min(y0, r.y0), std::max(x1, r.x1), std::max(y1, r.y1));
+        }
+
+        Rect get_intersection(const Rect& r) const {
+            return Rect(std::max(x0, r.x0), std::max(y0, r.y0), std::min(x1, r.x1), std::min(y1, r.y1));
+        }
+    };
+
+    // Merge strategies
+    enum Merge_Strategy {
+        merge_tiled,        // blend every layer into a cache-sized tile, then write the tile
+        merge_fused         // sweep the output once, blending all layers covering a short row chunk
+    };
+
+    // Layer slots of a Layer_System
+    /*
+        N slots in a static array, or, when N is 0, a list growing with the
+        number of layers. Inserting, removing and reordering only move the
+        layer handles, never their pixels.
+    */
+    template<typename T, std::size_t N>
+    struct _Layer_Slots {
+        Layer<T> _slots[N];
+
+        Layer<T>* data() { return _slots; }
+        const Layer<T>* data() const { return _slots; }
+        Layer<T>& operator[](const std::size_t i) { return _slots[i]; }
+        const Layer<T>& operator[](const std::size_t i) const { return _slots[i]; }
+
+        // Number of slots when holding count layers, and maximum number of layers
+        std::size_t size(const std::size_t) const { return N; }
+        std::size_t max_size() const { return N; }
+
+        // Insert layer at pos, count being the number of layers
+        void insert(const std::size_t pos, const std::size_t count, Layer<T>&& layer) {
+            std::move_backward(_slots + pos, _slots + count, _slots + count + 1);
+            _slots[pos] = std::move(layer);
+        }
+
+        void erase(const std::size_t pos, const std::size_t count) {
+            std::move(_slots + pos + 1, _slots + count, _slots + pos);
+            _slots[count - 1] = Layer<T>();
+        }
+    };
+
     template<typename T>
-    class Layer {
-        CImg<T> *_data;
-        bool _is_visible;
+    struct _Layer_Slots<T, 0> {
+        std::vector<Layer<T> > _slots;
+
+        Layer<T>* data() { return _slots.data(); }
+        const Layer<T>* data() const { return _slots.data(); }
+        Layer<T>& operator[](const std::size_t i) { return _slots[i]; }
+        const Layer<T>& operator[](const std::size_t i) const { return _slots[i]; }
+
+        std::size_t size(const std::size_t count) const { return count; }
+        std::size_t max_size() const { return _slots.max_size(); }
+
+        void insert(const std::size_t pos, const std::size_t, Layer<T>&& layer) {
+            _slots.insert(_slots.begin() + pos, std::move(layer));
+        }
+
+        void erase(const std::size_t pos, const std::size_t) {
+            _slots.erase(_slots.begin() + pos);
+        }
+    };
+
+    // Stack of layers, at most N of them, or any number when N is 0
+    template<typename T, std::size_t N = 0>
+    class Layer_System {
+        _Layer_Slots<T, N> _layers;
+        std::size_t index;
+        unsigned int _width, _allocated_width;
+        unsigned int _tile_width, _tile_height;
+        unsigned int _thread_count;
+        Merge_Strategy _strategy;
+
+        // Last composite, and the state of each layer it was built from
+        struct _Seen_Layer {
+            unsigned long revision;
+            Rect extent;
+        };
+        CImg<T> _composite;
+        std::vector<_Seen_Layer> _seen;
+        std::vector<Rect> _dirty, _updated;
+        std::vector<std::size_t> _edited;
+
+        // Partial composites around the focus layer (see set_cache_budget())
+        typedef typename CImg<T>::Tfloat Tfloat;
+        std::size_t _cache_budget, _cache_focus;
+        CImg<T> _cache_below;
+        CImg<Tfloat> _cache_add, _cache_mul;
+        std::vector<unsigned long> _cache_revision;
+
+        // Memory budget of the uncompressed layers (see set_compression_budget())
+        std::size_t _compression_budget;
     public:
+        // type definitions
+        typedef Layer<T>              value_type;
+        typedef Layer<T>*             iterator;
+        typedef const Layer<T>*       const_iterator;
+        typedef Layer<T>&             reference;
+        typedef const Layer<T>&       const_reference;
+        typedef std::size_t    size_type;
+
+        // Default Constructor
+        Layer_System():index(0), _tile_width(256), _tile_height(256), _thread_count(0),
+            _strategy(merge_tiled), _cache_budget(0), _cache_focus(0), _compression_budget(0) {}
+
+        ~Layer_System() {}
+
+        Layer_System(const Layer_System& sys) = default;
+        Layer_System(Layer_System&& sys) = default;
+        Layer_System& operator=(const Layer_System& sys) = default;
+        Layer_System& operator=(Layer_System&& sys) = default;
+
+        // iterator support
+        iterator        begin()       { return _layers.data(); }
+        const_iterator  begin() const { return _layers.data(); }
+        
+        iterator        end()       { return _layers.data()+size(); }
+        const_iterator  end() const { return _layers.data()+size(); }
+
+        // at() with range check
+        reference at(size_type i) { rangecheck(i); return _layers[i]; }
+        const_reference at(size_type i) const { rangecheck(i); return _layers[i]; }
+    
+        // front() and back()
+        reference front() 
+        { 
+            return _layers[0]; 
+        }
+        
+        const_reference front() const 
+        {
+            return _layers[0];
+        }
+        
+        reference back() 
+        { 
+            return _layers[size()-1]; 
+        }
+        
+        const_reference back() const 
+        { 
+            return _layers[size()-1]; 
+        }
+
+        // operator[]
+        reference operator[](size_type i) 
+        { 
+            return _layers[i];
+        }
+        
+        const_reference operator[](size_type i) const 
+        {     
+            return _layers[i]; 
+        }
+
+        // Size is N, or the number of layers when N is 0
+        size_type size() const { return _layers.size(index); }
+        size_type max_size() const { return _layers.max_size(); }
+
+        // Get index
+        std::size_t get_index() {return index; }
+
+        // Direct access to data (read-only)
+        const value_type* data() const { return _layers.data(); }
+        value_type* data() { return _layers.data(); }
+
+        // Return pointer to the pos-th layer of the list.
+        const_reference data(size_type pos) const {
+            if (pos >= index) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            return _layers[pos];
+        } 
+        reference data(size_type pos) {
+            if (pos >= index) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            return _layers[pos];
+        }
+
+        // check range
+        void rangecheck (size_type i) const {
+            if (i >= size()) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+        }
+
+        // Layer manipulation
+        void add_layer(const_reference layer) {
+            insert_at(index, value_type(layer));
+        }
+
+        void add_layer(value_type&& layer) {
+            insert_at(index, std::move(layer));
+        }
+
+        // Add a layer whose image is constructed in place from args (same arguments as a CImg<T> constructor)
+        template<typename... Args>
+        reference emplace_layer(Args&&... args) {
+            value_type layer;
+            layer._data = value_type::_new_data(std::forward<Args>(args)...);
+            insert_at(index, std::move(layer));
+            return _layers[index - 1];
+        }
+
+        void remove_layer() {
+            remove_at(index - 1);
+        }
+
+        // Insert layer at position pos (0 being the bottom layer), moving the layers above it up.
+        void insert_at(const size_type pos, value_type&& layer) {
+            if (pos > index || index == max_size()) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            _layers.insert(pos, index++, std::move(layer));
+            if (pos + 1 < index) _reordered();
+        }
+
+        void insert_at(const size_type pos, const_reference layer) {
+            insert_at(pos, value_type(layer));
+        }
+
+        void remove_at(const size_type pos) {
+            if (pos >= index) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            _layers.erase(pos, index--);
+            if (pos < index) _reordered();
+        }
+
+        // Move the layer at position from to position to, shifting the layers in between.
+        void move(const size_type from, const size_type to) {
+            if (from >= index || to >= index) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            value_type *const layers = _layers.data();
+            if (from < to) std::rotate(layers + from, layers + from + 1, layers + to + 1);
+            else if (to < from) std::rotate(layers + to, layers + from, layers + from + 1);
+            _reordered();
+        }
+
+        void swap(const size_type i, const size_type j) {
+            if (i >= index || j >= index) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            std::swap(_layers[i], _layers[j]);
+            _reordered();
+        }
+
+        value_type get_top_layer() {
+            if (index == 0) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            return _layers[index-1];
+        }
+
+        // Filters
+        /*
+            The overloads taking a layer by move reuse its pixels, and keep
+            its other properties (visibility, opacity, position...).
+        */
+
+        // Smooth image for n iterations and stored in CImgList
+        /*
+            iter is the number of total iterations. Successive calls on the same
+            layer continue from the last iterate (see Layer<T>::get_smooth()).
+        */
+        value_type smooth_layer(const_reference layer, const int index, const int iter=50) {
+            if (layer._tiles) {
+                throw "tiled layer";
+            }
+            value_type res(layer.get_smooth(index, iter));
+            _carry_alpha(res, layer);
+            if (layer._narrow) res.set_storage(layer.storage());
+            return res;
+        }
+
+        value_type smooth_layer(value_type&& layer, const int index, const int iter=50) {
+            if (layer._tiles) {
+                throw "tiled layer";
+            }
+            CImg<T> img = layer.get_smooth(index, iter);
+            _densify(layer);
+            const Storage_Format format = layer.storage();
+            if (layer._is_mapped) {
+                layer._set_data(value_type::_new_data(std::move(img)));
+                layer._touch();
+            } else layer.mutable_data().swap(img);
+            layer.set_storage(format);
+            return std::move(layer);
+        }
+
+        // Blur gradient image
+        /*
+        * sigma
+        */
+        value_type blur_gradient_layer(const_reference layer, const double sigma=0) {
+            if (layer._tiles) {
+                value_type res = _new_tiled(layer);
+                _blur_gradient(*res._tiles, *layer._tiles, sigma);
+                return res;
+            }
+            if (layer._sparse || layer._narrow || layer.has_alpha()) {
+                // The recursive blur needs the whole image in T, with unpremultiplied colors.
+                CImg<T> img = layer.get_image();
+                const CImg<T> alpha = layer.alpha();
+                if (!alpha.is_empty()) _unpremultiply(img, alpha);
+                img.blur_gradient(sigma);
+                if (!alpha.is_empty()) _premultiply(img, alpha);
+                value_type res(std::move(img));
+                _carry_alpha(res, layer);
+                if (layer._narrow) res.set_storage(layer.storage());
+                return res;
+            }
+            CImg<T> blur_gradient_img(layer.data(), false);
+            blur_gradient_img.blur_gradient(sigma);
+            return value_type(std::move(blur_gradient_img));
+        }
+
+        value_type blur_gradient_layer(value_type&& layer, const double sigma=0) {
+            if (layer._tiles) {
+                const std::shared_ptr<Tile_Store<T> > src = layer._tiles;
+                layer._tiles = _new_tiled(layer)._tiles;
+                _blur_gradient(*layer._tiles, *src, sigma);
+                layer._touch();
+                return std::move(layer);
+            }
+            _densify(layer);
+            const Storage_Format format = layer.storage();
+            CImg<T>& img = layer.mutable_data();
+            if (layer._alpha) _unpremultiply(img, *layer._alpha);
+            img.blur_gradient(sigma);
+            if (layer._alpha) _premultiply(img, *layer._alpha);
+            layer.set_storage(format);
+            return std::move(layer);
+        }
+
+        value_type exposure_layer(const_reference layer, const double gamma=1) {
+            if (layer._tiles) {
+                value_type res = _new_tiled(layer);
+                _exposure(*res._tiles, *layer._tiles, gamma);
+                return res;
+            }
+            if (layer._sparse) {
+                value_type res;
+                res._sparse = std::make_shared<Sparse_Image<T> >(*layer._sparse);
+                _exposure(*res._sparse, gamma);
+                return res;
+            }
+            if (layer._narrow) {
+                value_type res;
+                res._narrow = _get_exposure(*layer._narrow, gamma);
+                return res;
+            }
+            if (layer.has_alpha()) {
+                CImg<T> img(layer.data());
+                const CImg<T>& alpha = *layer._alpha;
+                _unpremultiply(img, alpha);
+                img.exposure(gamma);
+                _premultiply(img, alpha);
+                value_type res(std::move(img));
+                _carry_alpha(res, layer);
+                return res;
+            }
+            CImg<T> exposure_img(layer.data(), false);
+            exposure_img.exposure(gamma);
+            return value_type(std::move(exposure_img));
+        }
+
+        value_type exposure_layer(value_type&& layer, const double gamma=1) {
+            if (layer._tiles) {
+                // In place, unless the store is shared with another layer
+                const std::shared_ptr<Tile_Store<T> > src = layer._tiles;
+                if (src.use_count() > 2) layer._tiles = _new_tiled(layer)._tiles;
+                _exposure(*layer._tiles, *src, gamma);
+                layer._touch();
+                return std::move(layer);
+            }
+            if (layer._sparse) {
+                _exposure(layer.mutable_sparse_image(), gamma);
+                return std::move(layer);
+            }
+            if (layer._narrow) {
+                layer._narrow = _get_exposure(*layer._narrow, gamma);
+                layer._touch();
+                return std::move(layer);
+            }
+            CImg<T>& img = layer.mutable_data();
+            if (layer._alpha) _unpremultiply(img, *layer._alpha);
+            img.exposure(gamma);
+            if (layer._alpha) _premultiply(img, *layer._alpha);
+            return std::move(layer);
+        }
+
+        // Set visibility
+        void set_visible(reference layer) {
+            if (layer.visible()) {
+                return;
+            }
+            layer.set_visible();
+        }
+
+        void set_invisible(reference layer) {
+            if (!layer.visible()) {
+                return;
+            }
+            layer.set_invisible();
+            _compress();
+        }
+
+        // Dirty regions
+        /*
+            composite() keeps the last merged image and only recomposites the
+            regions that changed since. Changes made through the layers
+            (visibility, opacity, blend mode, replacing or adding/removing a
+            layer) are detected from their revision and dirty the whole layer.
+            Pixel edits done in place must be reported with mark_dirty(), or
+            made with draw_layer(). Their coordinates are relative to the
+            layer, not to the canvas.
+        */
+        void mark_dirty(const size_type pos) {
+            if (pos >= index) {
+                throw "index out of range";
+            }
+            _edit(pos);
+            _dirty.push_back(_extent(pos));
+        }
+
+        void mark_dirty(const size_type pos, const int x0, const int y0, const int x1, const int y1) {
+            if (pos >= index) {
+                throw "index out of range";
+            }
+            _edit(pos);
+            const Rect extent = _extent(pos);
+            const Rect r = extent.get_intersection(Rect(extent.x0 + x0, extent.y0 + y0, extent.x0 + x1, extent.y0 + y1));
+            if (!r.is_empty()) _dirty.push_back(r);
+        }
+
+        // Draw sprite into the pos-th layer at (x0,y0), and mark the drawn region dirty.
+        void draw_layer(const size_type pos, const int x0, const int y0, const CImg<T>& sprite, const float opacity=1) {
+            reference layer = data(pos);
+            if (!layer._has_pixels()) {
+                throw "empty layer";
+            }
+            const bool is_seen = pos < _seen.size() && _seen[pos].revision == layer._revision;
+            if (layer._sparse) {
+                layer.mutable_sparse_image().draw_image(x0, y0, sprite, opacity);
+            } else if (layer._tiles) {
+                // Only the tiles under the sprite are loaded.
+                const int
+                    cx0 = std::max(x0, 0), cx1 = std::min(x0 + sprite.width(), layer.width()) - 1,
+                    cy0 = std::max(y0, 0), cy1 = std::min(y0 + sprite.height(), layer.height()) - 1;
+                if (cx0 <= cx1 && cy0 <= cy1) {
+                    CImg<T> region = layer._tiles->get_crop(cx0, cy0, 0, 0, cx1, cy1, layer.depth() - 1, layer.spectrum() - 1);
+                    region.draw_image(x0 - cx0, y0 - cy0, sprite, opacity);
+                    layer._tiles->draw_image(cx0, cy0, 0, 0, region);
+                }
+                layer._touch();
+            } else {
+                // The sprite is opaque, so its colors are already premultiplied, and it covers the alpha plane.
+                layer.mutable_data().draw_image(x0, y0, sprite, opacity);
+                if (layer._alpha) {
+                    if (layer._alpha.use_count() > 1) layer._alpha = value_type::_copy(*layer._alpha);
+                    layer._alpha->draw_rectangle(x0, y0, 0, 0, x0 + sprite.width() - 1, y0 + sprite.height() - 1,
+                                                 sprite.depth() - 1, 0, (T)_white<T>(), opacity);
+                }
+            }
+            if (is_seen) _seen[pos].revision = layer._revision;
+            mark_dirty(pos, x0, y0, x0 + sprite.width() - 1, y0 + sprite.height() - 1);
+        }
+
+        // Regions that the next call to composite() will recomposite
+        std::vector<Rect> dirty_region() const {
+            std::vector<Rect> res(_dirty);
+            const size_type n = std::max(index, _seen.size());
+            for (size_type i = 0; i < n; i++) {
+                if (i >= _seen.size()) res.push_back(_extent(i));
+                else if (i >= index) res.push_back(_seen[i].extent);
+                else if (_seen[i].revision != _layers[i]._revision) {
+                    res.push_back(_seen[i].extent);
+                    res.push_back(_extent(i));
+                }
+            }
+            return _merge_rects(res, _canvas());
+        }
+
+        // Regions recomposited by the last call to composite()
+        const std::vector<Rect>& updated_region() const {
+            return _updated;
+        }
+
+        // Return the merged image, recompositing only the dirty regions.
+        const CImg<T>& composite() {
+            if (index == 0) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            const value_type& base = _layers[0];
+            if (!base._has_pixels() || !base.width()) {
+                _composite.assign();
+                _updated.clear();
+            } else if (!_composite.is_sameXYZC(base.width(), base.height(), base.depth(), base.spectrum()) ||
+                       _seen.empty()) {
+                _composite.assign(base.width(), base.height(), base.depth(), base.spectrum());
+                _updated.assign(1, _canvas());
+                _free_cache();
+            } else {
+                _updated = dirty_region();
+            }
+            const bool use_cache = !_updated.empty() && _update_cache();
+            // Layers below the cached focus layer are not read.
+            Rect r;
+            for (size_type i = 0; i < _updated.size(); i++) r = r.get_union(_updated[i]);
+            _unpack(r, use_cache ? _cache_focus : 0);
+            for (size_type i = 0; i < _updated.size(); i++) {
+                _merge(_composite, _updated[i], index, use_cache);
+            }
+            _compress();
+            _dirty.clear();
+            _edited.clear();
+            _seen.resize(index);
+            for (size_type i = 0; i < index; i++) {
+                _seen[i].revision = _layers[i]._revision;
+                _seen[i].extent = _extent(i);
+            }
+            return _composite;
+        }
+
+        // Memory budget of the partial composites used by composite()
+        /*
+            When a single layer k changes between two calls to composite(),
+            the composite of layers [0,k) and the effect of layers (k,index)
+            are cached. While only layer k keeps changing (editing, toggling
+            its visibility...), composite() then costs about one blend
+            instead of a merge of every layer.
+            Layers above k are cached as an affine map (result = add +
+            mul*value), which needs them all in blend_normal mode; otherwise
+            they are blended again at each call. With partially transparent
+            layers above k, results may differ from merge_layer() by a
+            rounding error.
+            The cache is dropped when any other layer changes or is marked
+            dirty (see mark_dirty()), and not built
+            if it does not fit in the budget (in bytes, 0 disables it).
+        */
+        void set_cache_budget(const std::size_t bytes) {
+            _cache_budget = bytes;
+            if (cache_size() > bytes) _free_cache();
+        }
 
-        //  Default deconstructor
-        ~Layer() {}
+        std::size_t cache_budget() const { return _cache_budget; }
 
-        // type definitions
-        typedef CImg<T>              value_type;
-        typedef CImg<T>*             iterator;
-        typedef const CImg<T>*       const_iterator;
-        typedef CImg<T>&             reference;
-        typedef const CImg<T>&       const_reference;
-        typedef std::size_t          size_type;
+        // Memory currently used by the partial composites (in bytes)
+        std::size_t cache_size() const {
+            return _cache_below.size()*sizeof(T) + (_cache_add.size() + _cache_mul.size())*sizeof(Tfloat);
+        }
 
-        //  Default constructor
-        /**
-         * Construct a new empty layer instance
-        **/
-        Layer(): _data(0), _is_visible(true){}
+        // Tile size used by merge_layer()
+        /*
+            A tile of every channel plane is composited at a time, so
+            w*h*sizeof(T) should fit in the L2 cache.
+        */
+        void set_tile_size(const unsigned int w, const unsigned int h) {
+            if (!w || !h) {
+                throw "invalid tile size";
+            }
+            _tile_width = w;
+            _tile_height = h;
+        }
 
-        //  Construct layer of specific image
-        /**
-         * \param img CImg instance
-        **/
-        Layer(const CImg<T>& img) {
-            _data = new CImg<T>(img);
-            _is_visible = true;
+        unsigned int tile_width() const { return _tile_width; }
+        unsigned int tile_height() const { return _tile_height; }
+
+        // Number of threads used by merge_layer()
+        /*
+            0 uses one thread per CPU, 1 runs the serial path. Tiles are
+            independent, so the result does not depend on the thread count.
+            Requires OpenMP (cimg_use_openmp), otherwise merging is serial.
+        */
+        void set_thread_count(const unsigned int n) { _thread_count = n; }
+        unsigned int thread_count() const { return _thread_count; }
+
+        // Strategy used by merge_layer() and composite()
+        /*
+            Both give the same result. merge_tiled suits stacks of large
+            layers, merge_fused reads every contributing layer pixel once per
+            output pixel and writes the output once, without a tile buffer.
+        */
+        void set_merge_strategy(const Merge_Strategy strategy) { _strategy = strategy; }
+        Merge_Strategy merge_strategy() const { return _strategy; }
+
+        // Merge layer
+        /*
+            Visible layers are blended with their opacity and blend mode over
+            the bottom layer at their position, clipped to its size.
+        */
+        value_type merge_layer() {
+            if (index == 0) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            const value_type& base = _layers[0];
+            if (!base._has_pixels() || !base.width()) {
+                return value_type(CImg<T>());
+            }
+            value_type res;
+            res._data = value_type::_new_pooled(base.width(), base.height(), base.depth(), base.spectrum());
+            _unpack(_canvas());
+            _merge(*res._data, _canvas(), index, false);
+            _compress();
+            return res;
         }
 
-        Layer(const CImg<T> &img, const bool is_visible): _is_visible(true)
-        {
-            _data = new CImg<T>(img);
-            _is_visible = is_visible;
+        // Merge layer into a new raw file, returned as a mapped layer (see Layer<T>::create_raw())
+        value_type merge_layer(const char *const filename) {
+            if (index == 0) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            const value_type& base = _layers[0];
+            if (!base._has_pixels() || !base.width()) {
+                throw "empty layer";
+            }
+            value_type res = value_type::create_raw(filename, base.width(), base.height(), base.depth(), base.spectrum());
+            _unpack(_canvas());
+            _merge(*res._data, _canvas(), index, false);
+            _compress();
+            return res;
         }
 
-        // Visibility
-        bool visible() {
-            return _is_visible;
+        // Merge layer into a new tiled layer (see Layer<T>::tiled()), one stored tile at a time
+        value_type merge_layer_tiled(const char *const filename=0, const unsigned int tile_width=256,
+                                     const unsigned int tile_height=256) {
+            if (index == 0) {
+                std::out_of_range e("array<>: index out of range");
+                //throw exception
+                throw "index out of range";
+            }
+            const value_type& base = _layers[0];
+            if (!base._has_pixels() || !base.width()) {
+                throw "empty layer";
+            }
+            value_type res = value_type::tiled(base.width(), base.height(), base.depth(), base.spectrum(),
+                                               filename, tile_width, tile_height);
+            Tile_Store<T>& store = *res._tiles;
+            const int
+                nx = (base.width() + tile_width - 1)/tile_width,
+                ny = (base.height() + tile_height - 1)/tile_height,
+                nb_tiles = nx*ny*base.depth()*base.spectrum();
+            const unsigned int nb_threads = _nb_threads();
+            cimg::unused(nb_threads);
+            _unpack(_canvas());
+            cimg_pragma_openmp(parallel num_threads(nb_threads) cimg_openmp_if(nb_threads > 1 && nb_tiles > 1)) {
+                CImg<T> tile(tile_width*tile_height);
+                cimg_pragma_openmp(for schedule(dynamic))
+                for (int t = 0; t < nb_tiles; ++t) {
+                    const int
+                        tx = t%nx, ty = (t/nx)%ny, z = (t/(nx*ny))%base.depth(), c = t/(nx*ny*base.depth()),
+                        x0 = tx*tile_width, y0 = ty*tile_height,
+                        w = std::min((int)tile_width, base.width() - x0),
+                        h = std::min((int)tile_height, base.height() - y0);
+                    const std::shared_ptr<CImg<T> > out = store.tile_for_write(tx, ty, z, c);
+                    _merge_tile(out->_data, tile_width, tile._data, x0, y0, z, c, w, h, index, false);
+                }
+            }
+            _compress();
+            return res;
         }
 
-        void set_visible() {
-            _is_visible = true;
+        // Memory accounting
+        /*
+            Pixel storage of Layer<T> allocated and freed so far (in bytes,
+            see Layer<T>::allocated_bytes()), whichever system the layers
+            belong to, and what is still allocated. The memory used by
+            composite() is given by composite_size().
+        */
+        static unsigned long long allocated_bytes() { return value_type::allocated_bytes(); }
+        static unsigned long long freed_bytes() { return value_type::freed_bytes(); }
+        static unsigned long long live_bytes() { return allocated_bytes() - freed_bytes(); }
+
+        std::size_t composite_size() const {
+            return _composite.size()*sizeof(T) + cache_size();
         }
 
-        void set_invisible() {
-            _is_visible = false;
+        // Memory budget of the uncompressed layers
+        /*
+            When the pixels of the layers exceed the budget (in bytes, 0
+            disables compression) after a merge or set_invisible(), layers
+            are compressed in memory (see Layer<T>::compress()): hidden
+            layers first, then the least recently used ones. Merging
+            decompresses the visible layers it needs, so a budget smaller
+            than the visible layers makes each merge decompress them again.
+        */
+        void set_compression_budget(const std::size_t bytes) {
+            _compression_budget = bytes;
+            _compress();
         }
 
-        void display() {
-            data().display();
+        std::size_t compression_budget() const { return _compression_budget; }
+
+        // Compression statistics
+        /*
+            Memory of the uncompressed layer pixels, of the compressed ones,
+            and what they would take uncompressed (in bytes). Mapped, tiled
+            and sparse layers are not counted.
+        */
+        std::size_t uncompressed_size() const {
+            std::size_t res = 0;
+            for (size_type i = 0; i < index; i++) res += _pixel_size(_layers[i]);
+            return res;
         }
 
-        // Data
-        CImg<T> data() {
-            return *_data;
+        std::size_t compressed_size() const {
+            std::size_t res = 0;
+            for (size_type i = 0; i < index; i++) res += _layers[i].compressed_size();
+            return res;
         }
 
-        // Clear
-        reference clear() {
-            _data = new CImg<T>();
-            _is_visible = true;
+        std::size_t compressed_raw_size() const {
+            std::size_t res = 0;
+            for (size_type i = 0; i < index; i++) {
+                const value_type& layer = _layers[i];
+                if (layer._packed) res += layer._packed->raw_size();
+                if (layer._packed_alpha) res += layer._packed_alpha->raw_size();
+            }
+            return res;
         }
 
-    };
+        static unsigned long compress_count() { return value_type::compress_count(); }
+        static unsigned long decompress_count() { return value_type::decompress_count(); }
 
-    template<typename T, std::size_t N>
-    class Layer_System {
-        Layer<T> _layers[N];
-        std::size_t index;
-        unsigned int _width, _allocated_width;
-    public:
-        // type definitions
-        typedef Layer<T>              value_type;
-        typedef Layer<T>*             iterator;
-        typedef const Layer<T>*       const_iterator;
-        typedef Layer<T>&             reference;
-        typedef const Layer<T>&       const_reference;
-        typedef std::size_t    size_type;
+    private:
+        // Exposure of the stored tiles of a sparse image (absent tiles staying transparent)
+        static void _exposure(Sparse_Image<T>& img, const double gamma) {
+            const int nx = (img.width() + img.tile_width() - 1)/img.tile_width();
+            for (std::size_t i = 0; i < img.nb_tiles(); ++i) {
+                const unsigned int tx = i%nx, ty = i/nx;
+                if (!img.tile(tx, ty)) continue;
+                const CImg<T> *const alpha = img.alpha_tile(tx, ty);
+                CImg<T>& tile = img.tile_for_write(tx, ty);
+                if (alpha) _unpremultiply(tile, *alpha);
+                tile.exposure(gamma);
+                if (alpha) _premultiply(tile, *alpha);
+            }
+        }
 
-        // Default Constructor
-        Layer_System():index(0) {}
+        // Exposure of 16-bit float pixels, converted to T 256 values at a time
+        static std::shared_ptr<typename value_type::_Narrow> _get_exposure(const typename value_type::_Narrow& img,
+                                                                           const double gamma) {
+            const std::shared_ptr<typename value_type::_Narrow> res = std::make_shared<typename value_type::_Narrow>(img);
+            const long n = (long)img.data.size(), nb_spans = (n + 255)/256, plane = (long)img.alpha.size();
+            cimg_pragma_openmp(parallel for cimg_openmp_if_size(n, 65536))
+            for (long k = 0; k < nb_spans; ++k) {
+                const int nb = (int)std::min(256L, n - k*256);
+                unsigned short *const ptr = res->data._data + k*256;
+                CImg<T> span(nb), alpha;
+                _widen_span(span._data, ptr, nb, img.format);
+                if (plane) {
+                    // Alpha of each value, the span possibly crossing a channel plane
+                    alpha.assign(nb);
+                    for (int i = 0; i < nb; ) {
+                        const long offset = (k*256 + i)%plane;
+                        const int m = (int)std::min((long)nb - i, plane - offset);
+                        _widen_span(alpha._data + i, img.alpha._data + offset, m, img.format);
+                        i += m;
+                    }
+                    _unpremultiply(span, alpha);
+                }
+                span.exposure(gamma);
+                if (plane) _premultiply(span, alpha);
+                _narrow_span(ptr, span._data, nb, img.format);
+            }
+            return res;
+        }
 
-        ~Layer_System() {}
+        // Replace the tiles of a sparse layer by the whole image (premultiplied colors) and its alpha plane
+        static void _densify(value_type& layer) {
+            if (!layer._sparse) return;
+            layer._data = value_type::_new_data(layer._sparse->get_image());
+            layer._alpha = value_type::_new_data(layer._sparse->get_alpha());
+            layer._sparse.reset();
+            layer._touch();
+        }
 
-        // iterator support
-        iterator        begin()       { return _layers; }
-        const_iterator  begin() const { return _layers; }
-        
-        iterator        end()       { return _layers+N; }
-        const_iterator  end() const { return _layers+N; }
+        // Give res, the filtered premultiplied colors of layer, the alpha plane of layer
+        static void _carry_alpha(value_type& res, const_reference layer) {
+            if (!layer.has_alpha()) return;
+            layer._unpack();
+            res._alpha = layer._alpha ? layer._alpha : value_type::_new_data(layer.alpha());
+        }
 
-        // at() with range check
-        reference at(size_type i) { rangecheck(i); return _layers[i]; }
-        const_reference at(size_type i) const { rangecheck(i); return _layers[i]; }
-    
-        // front() and back()
-        reference front() 
-        { 
-            return _layers[0]; 
+        static std::size_t _pixel_size(const value_type& layer) {
+            if (!layer._data || layer._is_mapped) return 0;
+            return (layer._data->size() + (layer._alpha ? layer._alpha->size() : 0))*sizeof(T);
         }
-        
-        const_reference front() const 
-        {
-            return _layers[0];
+
+        // Decompress the layers from first on that a merge of region r reads.
+        void _unpack(const Rect& r, const size_type first=0) const {
+            if (r.is_empty()) return;
+            for (size_type i = first; i < index; i++) {
+                const value_type& layer = _layers[i];
+                if (!i || (layer.visible() && layer._opacity > 0 && _extent(i).intersects(r))) layer._unpack();
+            }
         }
-        
-        reference back() 
-        { 
-            return _layers[N-1]; 
+
+        // Compress hidden layers, then the least recently used ones, until the others fit in the budget.
+        void _compress() {
+            if (!_compression_budget) return;
+            std::size_t size = uncompressed_size();
+            if (size <= _compression_budget) return;
+            std::vector<std::pair<unsigned long, size_type> > order;
+            for (size_type i = 0; i < index; i++) {
+                const value_type& layer = _layers[i];
+                if (_pixel_size(layer)) order.push_back(std::make_pair(layer.visible() ? layer._used + 1 : 0, i));
+            }
+            std::sort(order.begin(), order.end());
+            for (size_type i = 0; i < order.size() && size > _compression_budget; i++) {
+                value_type& layer = _layers[order[i].second];
+                size -= _pixel_size(layer);
+                layer.compress();
+            }
         }
-        
-        const_reference back() const 
-        { 
-            return _layers[N-1]; 
+
+        // Empty temporary tiled layer with the size and tiling of a tiled layer
+        static value_type _new_tiled(const value_type& layer) {
+            const Tile_Store<T>& store = *layer._tiles;
+            return value_type::tiled(store.width(), store.height(), store.depth(), store.spectrum(), 0,
+                                     store.tile_width(), store.tile_height());
         }
 
-        // operator[]
-        reference operator[](size_type i) 
-        { 
-            return _layers[i];
+        // Exposure of a tiled image, one tile at a time (dst may be src)
+        static void _exposure(Tile_Store<T>& dst, Tile_Store<T>& src, const double gamma) {
+            Tile_Cache<T>& cache = Tile_Cache<T>::instance();
+            const int nb_tiles = (int)src.nb_tiles();
+            cimg_pragma_openmp(parallel for schedule(dynamic) cimg_openmp_if(nb_tiles > 1))
+            for (int t = 0; t < nb_tiles; ++t) {
+                const std::shared_ptr<CImg<T> >
+                    ptrs = cache.get(src, t, &dst == &src),
+                    ptrd = &dst == &src ? ptrs : cache.get(dst, t, true);
+                if (ptrd != ptrs) *ptrd = *ptrs;
+                ptrd->exposure(gamma);
+            }
         }
-        
-        const_reference operator[](size_type i) const 
-        {     
-            return _layers[i]; 
+
+        // Blur gradient of a tiled image, matching CImg<T>::get_blur_gradient() up to the blur halo
+        /*
+            Each tile is blurred with a halo of 6 times the blur radius read
+            from its neighbours (the recursive filter response being
+            negligible past it), into a temporary store. The second pass
+            normalizes to [0,255] with the extrema of the whole image.
+        */
+        static void _blur_gradient(Tile_Store<T>& dst, Tile_Store<T>& src, const double sigma) {
+            const float radius = (float)cimg::abs(30*std::cos(sigma));
+            const int
+                w = src.width(), h = src.height(), d = src.depth(), s = src.spectrum(),
+                tw = src.tile_width(), th = src.tile_height(),
+                nx = (w + tw - 1)/tw, ny = (h + th - 1)/th,
+                halo = (int)std::ceil(6*radius) + 1,
+                hx = w > 1 ? halo : 0, hy = h > 1 ? halo : 0;
+            Tile_Store<Tfloat> blurred(0, w, h, d, s, tw, th);
+            Tfloat m = cimg::type<Tfloat>::max(), M = cimg::type<Tfloat>::min();
+            cimg_pragma_openmp(parallel for schedule(dynamic) cimg_openmp_if(nx*ny*s > 1))
+            for (int t = 0; t < nx*ny*s; ++t) {
+                const int
+                    x0 = (t%nx)*tw, y0 = ((t/nx)%ny)*th, c = t/(nx*ny),
+                    x1 = std::min(x0 + tw, w) - 1, y1 = std::min(y0 + th, h) - 1;
+                CImg<Tfloat> region = src.get_crop(x0 - hx, y0 - hy, 0, c, x1 + hx, y1 + hy, d - 1, c);
+                region.blur(radius).crop(hx, hy, 0, 0, hx + x1 - x0, hy + y1 - y0, d - 1, 0);
+                Tfloat tm;
+                const Tfloat tM = region.max_min(tm);
+                cimg_pragma_openmp(critical(_blur_gradient)) {
+                    m = std::min(m, tm);
+                    M = std::max(M, tM);
+                }
+                blurred.draw_image(x0, y0, 0, c, region);
+            }
+            // Same arithmetic as CImg<T>::normalize(0,255)
+            const Tfloat a = 0, b = 255;
+            const bool is_flat = m == M, is_normalized = m == a && M == b;
+            Tile_Cache<Tfloat>& blurred_cache = Tile_Cache<Tfloat>::instance();
+            Tile_Cache<T>& cache = Tile_Cache<T>::instance();
+            const int nb_tiles = (int)dst.nb_tiles();
+            cimg_pragma_openmp(parallel for schedule(dynamic) cimg_openmp_if(nb_tiles > 1))
+            for (int t = 0; t < nb_tiles; ++t) {
+                const std::shared_ptr<CImg<Tfloat> > ptrs = blurred_cache.get(blurred, t, false);
+                const std::shared_ptr<CImg<T> > ptrd = cache.get(dst, t, true);
+                const Tfloat *const ps = ptrs->data();
+                T *const pd = ptrd->data();
+                for (std::size_t i = 0; i < ptrd->size(); ++i) {
+                    const Tfloat v = is_flat ? a : is_normalized ? ps[i] : (Tfloat)((ps[i] - m)/(M - m)*(b - a) + a);
+                    pd[i] = cimg::type<T>::is_float() ? (T)v : (T)cimg::round(v);
+                }
+            }
         }
 
-        // Size is constant
-        static size_type size() { return N; }
-        static size_type max_size() { return N; }
+        // Pixels of the pos-th layer changed in place, its revision being unchanged.
+        /*
+            The partial composites only hold the layers other than the focus
+            one (see set_cache_budget()), so they must be rebuilt unless it
+            is the edited layer.
+        */
+        void _edit(const size_type pos) {
+            _edited.push_back(pos);
+            if (pos != _cache_focus) _free_cache();
+        }
 
-        // Get index
-        std::size_t get_index() {return index; }
+        // Layers changed position: composite() finds the moved layers from their revisions.
+        void _reordered() {
+            _edited.clear();
+            _free_cache();
+        }
 
-        // Direct access to data (read-only)
-        const value_type* data() const { return _layers; }
-        value_type* data() { return _layers; }
+        void _free_cache() {
+            _cache_below.assign();
+            _cache_add.assign();
+            _cache_mul.assign();
+            _cache_revision.clear();
+        }
 
-        // Return pointer to the pos-th layer of the list.
-        const_reference data(size_type pos) const {
-            if (pos >= index) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+        // Make the partial composites match the current layers, return false if they cannot be used.
+        bool _update_cache() {
+            if (!_cache_budget || index < 2) {
+                _free_cache();
+                return false;
             }
-            return _layers[pos];
-        } 
-        reference data(size_type pos) {
-            if (pos >= index) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+            if (_cache_revision.size() == index) {
+                bool is_valid = true;
+                for (size_type i = 0; i < index && is_valid; i++) {
+                    is_valid = i == _cache_focus || _layers[i]._revision == _cache_revision[i];
+                }
+                if (is_valid) return true;
             }
-            return _layers[pos];
+
+            // Focus on the layer that changed since the last composite, if it is the only one.
+            size_type focus = 0, nb_changed = 0;
+            if (_seen.size() == index) {
+                for (size_type i = 0; i < index; i++) {
+                    if (_seen[i].revision != _layers[i]._revision ||
+                        std::find(_edited.begin(), _edited.end(), i) != _edited.end()) {
+                        focus = i;
+                        ++nb_changed;
+                    }
+                }
+            }
+            const std::size_t
+                siz = _composite.size(),
+                below_size = focus ? siz*sizeof(T) : 0,
+                above_size = 2*siz*sizeof(Tfloat);
+            _free_cache();
+            if (nb_changed != 1 || below_size > _cache_budget) return false;
+            _unpack(_canvas());
+
+            _cache_focus = focus;
+            if (focus) {
+                _cache_below.assign(_composite._width, _composite._height, _composite._depth, _composite._spectrum);
+                _merge(_cache_below, _canvas(), focus, false);
+            }
+            bool is_affine = below_size + above_size <= _cache_budget;
+            for (size_type i = focus + 1; i < index && is_affine; i++) {
+                const value_type& layer = _layers[i];
+                is_affine = !layer.visible() || !layer._has_pixels() || layer._opacity <= 0 ||
+                    (layer._blend_mode == blend_normal && !layer._tiles);
+            }
+            if (is_affine) _cache_above();
+            _cache_revision.resize(index);
+            for (size_type i = 0; i < index; i++) {
+                _cache_revision[i] = _layers[i]._revision;
+            }
+            return true;
         }
 
-        // check range (may be private because it is static)
-        static void rangecheck (size_type i) {
-            if (i >= size()) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+        // Compose the layers above the focus layer into the affine map value -> add + mul*value.
+        void _cache_above() {
+            const CImg<T>& canvas = _composite;
+            _cache_add.assign(canvas._width, canvas._height, canvas._depth, canvas._spectrum, 0);
+            _cache_mul.assign(canvas._width, canvas._height, canvas._depth, canvas._spectrum, 1);
+            for (size_type i = _cache_focus + 1; i < index; i++) {
+                const value_type& layer = _layers[i];
+                if (!layer.visible() || !layer._has_pixels() || layer._opacity <= 0) continue;
+                const int
+                    x0 = std::max(layer._x, 0), x1 = std::min(layer._x + layer.width(), canvas.width()),
+                    y0 = std::max(layer._y, 0), y1 = std::min(layer._y + layer.height(), canvas.height()),
+                    z0 = std::max(layer._z, 0), z1 = std::min(layer._z + layer.depth(), canvas.depth()),
+                    s = std::min(layer.spectrum(), canvas.spectrum());
+                if (x0 >= x1 || y0 >= y1 || z0 >= z1) continue;
+                if (layer._sparse) {
+                    // Absent tiles are transparent and leave the map unchanged.
+                    const Sparse_Image<T>& img = *layer._sparse;
+                    const int tw = img.tile_width(), th = img.tile_height();
+                    for (int ty = (y0 - layer._y)/th; ty*th < y1 - layer._y; ++ty) {
+                        for (int tx = (x0 - layer._x)/tw; tx*tw < x1 - layer._x; ++tx) {
+                            const CImg<T> *const t = img.tile(tx, ty), *const ta = img.alpha_tile(tx, ty);
+                            if (!t) continue;
+                            const int
+                                xa = std::max(x0, layer._x + tx*tw), xb = std::min(x1, layer._x + (tx + 1)*tw),
+                                ya = std::max(y0, layer._y + ty*th), yb = std::min(y1, layer._y + (ty + 1)*th);
+                            for (int c = 0; c < s; ++c) for (int z = z0; z < z1; ++z) for (int y = ya; y < yb; ++y) {
+                                const int xl = xa - layer._x - tx*tw, yl = y - layer._y - ty*th, zl = z - layer._z;
+                                _cache_span(_cache_add.data(xa, y, z, c), _cache_mul.data(xa, y, z, c),
+                                            t->data(xl, yl, zl, c), ta ? ta->data(xl, yl, zl) : 0, xb - xa, layer._opacity);
+                            }
+                        }
+                    }
+                    continue;
+                }
+                if (layer._narrow) {
+                    const typename value_type::_Narrow& img = *layer._narrow;
+                    cimg_pragma_openmp(parallel for cimg_openmp_collapse(3)
+                                       cimg_openmp_if_size((cimg_ulong)(x1 - x0)*(y1 - y0)*(z1 - z0)*s, 65536))
+                    for (int c = 0; c < s; ++c) for (int z = z0; z < z1; ++z) for (int y = y0; y < y1; ++y) {
+                        T buf[256], abuf[256];
+                        for (int x = x0; x < x1; x += 256) {
+                            const int n = std::min(256, x1 - x), xl = x - layer._x, yl = y - layer._y, zl = z - layer._z;
+                            _widen_span(buf, img.data.data(xl, yl, zl, c), n, img.format);
+                            if (img.alpha) _widen_span(abuf, img.alpha.data(xl, yl, zl), n, img.format);
+                            _cache_span(_cache_add.data(x, y, z, c), _cache_mul.data(x, y, z, c), buf,
+                                        img.alpha ? abuf : 0, n, layer._opacity);
+                        }
+                    }
+                    continue;
+                }
+                const CImg<T>& img = *layer._data;
+                cimg_pragma_openmp(parallel for cimg_openmp_collapse(3)
+                                   cimg_openmp_if_size((cimg_ulong)(x1 - x0)*(y1 - y0)*(z1 - z0)*s, 65536))
+                for (int c = 0; c < s; ++c) for (int z = z0; z < z1; ++z) for (int y = y0; y < y1; ++y) {
+                    const int xl = x0 - layer._x, yl = y - layer._y, zl = z - layer._z;
+                    _cache_span(_cache_add.data(x0, y, z, c), _cache_mul.data(x0, y, z, c), img.data(xl, yl, zl, c),
+                                layer._alpha ? layer._alpha->data(xl, yl, zl) : 0, x1 - x0, layer._opacity);
+                }
             }
         }
 
-        // Layer manipulation
-        void add_layer(value_type layer) {
-            if (index == N) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+        // Compose n pixels of a blend_normal layer (alpha plane ptrl, if any) into the affine map.
+        static void _cache_span(Tfloat *const ptra, Tfloat *const ptrm, const T *const ptrs, const T *const ptrl,
+                                const int n, const Tfloat opacity) {
+            const Tfloat copacity = 1 - opacity, iwhite = 1/(Tfloat)_white<T>();
+            if (ptrl) for (int x = 0; x < n; ++x) {
+                const Tfloat ca = 1 - opacity*ptrl[x]*iwhite;
+                ptra[x] = opacity*ptrs[x] + ca*ptra[x];
+                ptrm[x] *= ca;
+            } else for (int x = 0; x < n; ++x) {
+                ptra[x] = opacity*ptrs[x] + copacity*ptra[x];
+                ptrm[x] *= copacity;
             }
-            _layers[index++] = layer;
         }
 
-        void remove_layer() {
-            index--;
+        // Canvas rectangle (size of the bottom layer)
+        Rect _canvas() const {
+            if (!index || !_layers[0]._has_pixels()) return Rect();
+            return Rect(0, 0, _layers[0].width() - 1, _layers[0].height() - 1);
         }
 
-        value_type get_top_layer() {
-            if (index == 0) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+        // Bounding box of the pos-th layer in the canvas
+        Rect _extent(const size_type pos) const {
+            const value_type& layer = _layers[pos];
+            if (!layer._has_pixels()) return Rect();
+            const int x0 = pos ? layer._x : 0, y0 = pos ? layer._y : 0;
+            return Rect(x0, y0, x0 + layer.width() - 1, y0 + layer.height() - 1);
+        }
+
+        // Clip rectangles to the canvas and merge the overlapping ones.
+        /*
+            Past 16 rectangles, their bounding box is used instead.
+        */
+        static std::vector<Rect> _merge_rects(const std::vector<Rect>& rects, const Rect& canvas) {
+            std::vector<Rect> res;
+            for (size_type i = 0; i < rects.size(); i++) {
+                Rect r = rects[i].get_intersection(canvas);
+                if (r.is_empty()) continue;
+                for (size_type j = 0; j < res.size(); ) {
+                    if (res[j].intersects(r)) {
+                        r = r.get_union(res[j]);
+                        res.erase(res.begin() + j);
+                        j = 0;
+                    } else j++;
+                }
+                res.push_back(r);
             }
-            return _layers[index-1];
+            if (res.size() > 16) {
+                Rect r;
+                for (size_type i = 0; i < res.size(); i++) r = r.get_union(res[i]);
+                res.assign(1, r);
+            }
+            return res;
         }
 
-        // Smooth image for n iterations and stored in CImgList
+        // Composite layers [0,end) into region r of res with the current strategy.
+        void _merge(CImg<T>& res, const Rect& r, const size_type end, const bool use_cache) const {
+            if (_strategy == merge_fused && !use_cache) _merge_fused(res, r, end);
+            else _merge_tiled(res, r, end, use_cache);
+        }
+
+        unsigned int _nb_threads() const {
+            return _thread_count ? _thread_count : cimg::nb_cpus();
+        }
+
+        // Composite layers [0,end) into region r of res in a single sweep over the output.
         /*
-            iter is the number of total iterations
+            Rows are split into chunks of 256 pixels, small enough to stay in
+            L1 cache while every layer covering the chunk is blended in; each
+            chunk is then written once to res. Layers are filtered once per
+            row, so a chunk only visits the layers overlapping it.
         */
-        value_type* smooth_layer(value_type layer, const int index, const int iter=50) {
-            CImg<T> img = layer.data();
-            CImg<T> smooth_img = img.get_smooth(index, iter);
-            return new Layer<T>(smooth_img);
+        void _merge_fused(CImg<T>& res, const Rect& r, const size_type end) const {
+            if (r.is_empty()) return;
+            const int
+                h = r.y1 - r.y0 + 1,
+                nb_rows = h*res.depth()*res.spectrum();
+            const unsigned int nb_threads = _nb_threads();
+            cimg::unused(nb_threads);
+            cimg_pragma_openmp(parallel num_threads(nb_threads) cimg_openmp_if(nb_threads > 1 && nb_rows > 1)) {
+                T chunk[256];
+                std::vector<size_type> active;
+                cimg_pragma_openmp(for schedule(dynamic, 16))
+                for (int row = 0; row < nb_rows; ++row) {
+                    const int y = r.y0 + row%h, z = (row/h)%res.depth(), c = row/(h*res.depth());
+                    active.clear();
+                    for (size_type i = 1; i < end; i++) {
+                        const value_type& layer = _layers[i];
+                        if (!layer.visible() || !layer._has_pixels() || layer._opacity <= 0) continue;
+                        if (y >= layer._y && y < layer._y + layer.height() &&
+                            z >= layer._z && z < layer._z + layer.depth() && c < layer.spectrum() &&
+                            layer._x <= r.x1 && layer._x + layer.width() > r.x0) active.push_back(i);
+                    }
+                    for (int x0 = r.x0; x0 <= r.x1; x0 += 256) {
+                        const int w = std::min(256, r.x1 + 1 - x0);
+                        size_type first = active.size();
+                        while (first > 0 && !_covers(_layers[active[first - 1]], x0, y, z, c, w, 1)) --first;
+                        if (first) {
+                            const value_type& base = _layers[active[first - 1]];
+                            _read_rows(chunk, base, x0 - base._x, y - base._y, z - base._z, c, w, 1);
+                        } else {
+                            _read_rows(chunk, _layers[0], x0, y, z, c, w, 1);
+                        }
+                        for (size_type j = first; j < active.size(); j++) {
+                            _draw_tile(chunk, x0, y, z, c, w, 1, _layers[active[j]]);
+                        }
+                        std::memcpy(res.data(x0, y, z, c), chunk, w*sizeof(T));
+                    }
+                }
+            }
         }
 
-        // Blur gradient image
+        // Composite the visible layers into region r of res, one tile of a channel plane at a time.
         /*
-        * sigma
+            Each tile is built in a scratch buffer that stays in cache while
+            every layer is drawn into it, then written once to res.
         */
-        value_type* blur_gradient_layer(value_type layer, const double sigma=0) {
-            CImg<T> img = layer.data();
-            CImg<T> blur_gradient_img = img.get_blur_gradient(sigma);
-            return new Layer<T>(blur_gradient_img);
+        void _merge_tiled(CImg<T>& res, const Rect& r, const size_type end, const bool use_cache) const {
+            if (r.is_empty()) return;
+            const int
+                nx = (r.x1 - r.x0 + _tile_width)/_tile_width,
+                ny = (r.y1 - r.y0 + _tile_height)/_tile_height,
+                nb_tiles = nx*ny*res.depth()*res.spectrum();
+            const unsigned int nb_threads = _nb_threads();
+            cimg::unused(nb_threads);
+            cimg_pragma_openmp(parallel num_threads(nb_threads) cimg_openmp_if(nb_threads > 1 && nb_tiles > 1)) {
+                CImg<T> tile(_tile_width*_tile_height);
+                cimg_pragma_openmp(for schedule(dynamic))
+                for (int t = 0; t < nb_tiles; ++t) {
+                    const int
+                        x0 = r.x0 + (t%nx)*_tile_width,
+                        y0 = r.y0 + ((t/nx)%ny)*_tile_height,
+                        z = (t/(nx*ny))%res.depth(),
+                        c = t/(nx*ny*res.depth()),
+                        w = std::min((int)_tile_width, r.x1 + 1 - x0),
+                        h = std::min((int)_tile_height, r.y1 + 1 - y0);
+                    _merge_tile(res.data(x0, y0, z, c), res._width, tile._data, x0, y0, z, c, w, h, end, use_cache);
+                }
+            }
         }
 
-        value_type* exposure_layer(value_type layer, const double gamma=1) {
-            CImg<T> img = layer.data();
-            CImg<T> exposure_img = img.get_exposure(gamma);
-            return new Layer<T>(exposure_img);
+        // Tell if a layer is opaque over the whole tile (x0,y0,z,c)-(x0+w-1,y0+h-1,z,c).
+        static bool _covers(const value_type& layer, const int x0, const int y0, const int z, const int c,
+                            const int w, const int h) {
+            if (!layer._is_opaque()) return false;
+            const int zl = z - layer._z;
+            return x0 >= layer._x && y0 >= layer._y &&
+                x0 + w <= layer._x + layer.width() && y0 + h <= layer._y + layer.height() &&
+                zl >= 0 && zl < layer.depth() && c < layer.spectrum();
         }
 
-        // Set visibility
-        void set_visible(reference layer) {
-            if (layer.visible()) {
-                return;
+        // Blend n pixels of a layer in a single pass.
+        /*
+            blend_normal matches CImg<T>::draw_image() (SIMD kernels when opacity<1),
+            except for 8 and 16-bit pixels, blended in fixed point and rounded to nearest.
+        */
+        static void _draw_span(T *const ptrd, const T *const ptrs, const unsigned int n, const value_type& layer) {
+            const float opacity = layer._opacity;
+            switch (layer._blend_mode) {
+            case blend_multiply: _blend_span<_blend_multiply>(ptrd, ptrs, n, opacity); break;
+            case blend_screen: _blend_span<_blend_screen>(ptrd, ptrs, n, opacity); break;
+            case blend_overlay: _blend_span<_blend_overlay>(ptrd, ptrs, n, opacity); break;
+            case blend_add: _blend_span<_blend_add>(ptrd, ptrs, n, opacity); break;
+            case blend_darken: _blend_span<_blend_darken>(ptrd, ptrs, n, opacity); break;
+            case blend_lighten: _blend_span<_blend_lighten>(ptrd, ptrs, n, opacity); break;
+            default:
+                if (opacity >= 1) std::memcpy(ptrd, ptrs, n*sizeof(T));
+                else if (_is_fixed<T>::value) _blend_span<_blend_normal>(ptrd, ptrs, n, opacity);
+                else cimg::blend(ptrd, ptrs, n, opacity, 1 - opacity);
             }
-            layer.set_visible();
         }
 
-        void set_invisible(reference layer) {
-            if (!layer.visible()) {
+        // Blend n pixels of a layer with alpha plane ptra, one run of equal coverage at a time.
+        /*
+            Transparent runs are skipped, opaque runs go through _draw_span()
+            (memcpy in blend_normal), only partially transparent pixels need
+            the alpha arithmetic.
+        */
+        static void _draw_alpha_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                                     const value_type& layer) {
+            const T white = (T)_white<T>();
+            for (unsigned int i = 0; i < n; ) {
+                unsigned int j = i + 1;
+                if (!(ptra[i] > 0)) {
+                    while (j < n && !(ptra[j] > 0)) ++j;
+                } else if (ptra[i] >= white) {
+                    while (j < n && ptra[j] >= white) ++j;
+                    _draw_span(ptrd + i, ptrs + i, j - i, layer);
+                } else {
+                    while (j < n && ptra[j] > 0 && ptra[j] < white) ++j;
+                    _draw_partial_span(ptrd + i, ptrs + i, ptra + i, j - i, layer);
+                }
+                i = j;
+            }
+        }
+
+        static void _draw_partial_span(T *const ptrd, const T *const ptrs, const T *const ptra, const unsigned int n,
+                                       const value_type& layer) {
+            const float opacity = layer._opacity;
+            switch (layer._blend_mode) {
+            case blend_multiply: _blend_alpha_span<_blend_multiply>(ptrd, ptrs, ptra, n, opacity); break;
+            case blend_screen: _blend_alpha_span<_blend_screen>(ptrd, ptrs, ptra, n, opacity); break;
+            case blend_overlay: _blend_alpha_span<_blend_overlay>(ptrd, ptrs, ptra, n, opacity); break;
+            case blend_add: _blend_alpha_span<_blend_add>(ptrd, ptrs, ptra, n, opacity); break;
+            case blend_darken: _blend_alpha_span<_blend_darken>(ptrd, ptrs, ptra, n, opacity); break;
+            case blend_lighten: _blend_alpha_span<_blend_lighten>(ptrd, ptrs, ptra, n, opacity); break;
+            default: _blend_over_span(ptrd, ptrs, ptra, n, opacity);
+            }
+        }
+
+        // Draw a layer into the tile (x0,y0,z,c)-(x0+w-1,y0+h-1,z,c).
+        static void _draw_tile(T *const tile, const int x0, const int y0, const int z, const int c,
+                               const int w, const int h, const value_type& layer) {
+            if (!layer.visible() || !layer._has_pixels() || layer._opacity <= 0) return;
+            const int
+                zl = z - layer._z,
+                lx0 = std::max(x0, layer._x), lx1 = std::min(x0 + w, layer._x + layer.width()),
+                ly0 = std::max(y0, layer._y), ly1 = std::min(y0 + h, layer._y + layer.height());
+            if (zl < 0 || zl >= layer.depth() || c >= layer.spectrum() || lx0 >= lx1 || ly0 >= ly1) return;
+            if (layer._narrow) {
+                // Spans of 256 values converted to T in L1 cache
+                const typename value_type::_Narrow& img = *layer._narrow;
+                T buf[256], abuf[256];
+                for (int y = ly0; y < ly1; ++y) {
+                    for (int x = lx0; x < lx1; x += 256) {
+                        const int n = std::min(256, lx1 - x);
+                        T *const ptrd = tile + (y - y0)*w + x - x0;
+                        _widen_span(buf, img.data.data(x - layer._x, y - layer._y, zl, c), n, img.format);
+                        if (img.alpha) {
+                            _widen_span(abuf, img.alpha.data(x - layer._x, y - layer._y, zl), n, img.format);
+                            _draw_alpha_span(ptrd, buf, abuf, n, layer);
+                        } else _draw_span(ptrd, buf, n, layer);
+                    }
+                }
                 return;
             }
-            layer.set_invisible();
+            if (layer._sparse) {
+                // Absent tiles are skipped.
+                const Sparse_Image<T>& img = *layer._sparse;
+                const int tw = img.tile_width(), th = img.tile_height();
+                for (int ty = (ly0 - layer._y)/th; ty*th < ly1 - layer._y; ++ty) {
+                    for (int tx = (lx0 - layer._x)/tw; tx*tw < lx1 - layer._x; ++tx) {
+                        const CImg<T> *const t = img.tile(tx, ty), *const ta = img.alpha_tile(tx, ty);
+                        if (!t) continue;
+                        const int
+                            xa = std::max(lx0, layer._x + tx*tw), xb = std::min(lx1, layer._x + (tx + 1)*tw),
+                            ya = std::max(ly0, layer._y + ty*th), yb = std::min(ly1, layer._y + (ty + 1)*th);
+                        for (int y = ya; y < yb; ++y) {
+                            const int xl = xa - layer._x - tx*tw, yl = y - layer._y - ty*th;
+                            T *const ptrd = tile + (y - y0)*w + xa - x0;
+                            if (ta) _draw_alpha_span(ptrd, t->data(xl, yl, zl, c), ta->data(xl, yl, zl), xb - xa, layer);
+                            else _draw_span(ptrd, t->data(xl, yl, zl, c), xb - xa, layer);
+                        }
+                    }
+                }
+                return;
+            }
+            if (layer._tiles) {
+                // One stored tile at a time, kept pinned while its rows are drawn.
+                Tile_Store<T>& store = *layer._tiles;
+                const int tw = store.tile_width(), th = store.tile_height();
+                for (int ty = (ly0 - layer._y)/th; ty*th < ly1 - layer._y; ++ty) {
+                    for (int tx = (lx0 - layer._x)/tw; tx*tw < lx1 - layer._x; ++tx) {
+                        const std::shared_ptr<const CImg<T> > t = store.tile(tx, ty, zl, c);
+                        const int
+                            xa = std::max(lx0, layer._x + tx*tw), xb = std::min(lx1, layer._x + (tx + 1)*tw),
+                            ya = std::max(ly0, layer._y + ty*th), yb = std::min(ly1, layer._y + (ty + 1)*th);
+                        for (int y = ya; y < yb; ++y) {
+                            _draw_span(tile + (y - y0)*w + xa - x0, t->data(xa - layer._x - tx*tw, y - layer._y - ty*th),
+                                       xb - xa, layer);
+                        }
+                    }
+                }
+                return;
+            }
+            const CImg<T>& img = *layer._data;
+            for (int y = ly0; y < ly1; ++y) {
+                T *const ptrd = tile + (y - y0)*w + lx0 - x0;
+                const T *const ptrs = img.data(lx0 - layer._x, y - layer._y, zl, c);
+                if (layer._alpha) _draw_alpha_span(ptrd, ptrs, layer._alpha->data(lx0 - layer._x, y - layer._y, zl), lx1 - lx0, layer);
+                else _draw_span(ptrd, ptrs, lx1 - lx0, layer);
+            }
         }
 
-        // Merge layer
-        value_type* merge_layer() {
-            if (index == 0) {
-                std::out_of_range e("array<>: index out of range");
-                //throw exception
-                throw "index out of range";
+        // Composite layers [0,end) into a tile, from the partial composites if use_cache is set.
+        /*
+            The tile is built in the scratch buffer tile, then written to out
+            (pixel (x0,y0,z,c) of the result, rows being stride values apart).
+        */
+        void _merge_tile(T *const out, const unsigned int stride, T *const tile, const int x0, const int y0,
+                         const int z, const int c, const int w, const int h, const size_type end,
+                         const bool use_cache) const {
+            // Start from the topmost layer hiding everything below it in this tile.
+            size_type first = end - 1;
+            while (first > 0 && !_covers(_layers[first], x0, y0, z, c, w, h)) --first;
+            if (use_cache && first <= _cache_focus) {
+                if (_cache_focus) for (int y = 0; y < h; ++y) {
+                    std::memcpy(tile + y*w, _cache_below.data(x0, y0 + y, z, c), w*sizeof(T));
+                } else _read_rows(tile, _layers[0], x0, y0, z, c, w, h);
+                if (_cache_focus) _draw_tile(tile, x0, y0, z, c, w, h, _layers[_cache_focus]);
+                if (!_cache_add.is_empty()) {
+                    for (int y = 0; y < h; ++y) {
+                        const Tfloat
+                            *const ptra = _cache_add.data(x0, y0 + y, z, c),
+                            *const ptrm = _cache_mul.data(x0, y0 + y, z, c);
+                        T *const ptrd = out + y*stride, *const ptrt = tile + y*w;
+                        for (int x = 0; x < w; ++x) ptrd[x] = (T)(ptra[x] + ptrm[x]*ptrt[x]);
+                    }
+                    return;
+                }
+                first = _cache_focus;
+            } else {
+                const value_type& base = _layers[first];
+                const int bx = first ? base._x : 0, by = first ? base._y : 0, bz = first ? base._z : 0;
+                _read_rows(tile, base, x0 - bx, y0 - by, z - bz, c, w, h);
+            }
+            for (size_type i = first + 1; i < end; i++) {
+                _draw_tile(tile, x0, y0, z, c, w, h, _layers[i]);
+            }
+            for (int y = 0; y < h; ++y) {
+                std::memcpy(out + y*stride, tile + y*w, w*sizeof(T));
+            }
+        }
+
+        // Copy the region (x0,y0,z,c)-(x0+w-1,y0+h-1,z,c) of a layer into buf (w values per row).
+        static void _read_rows(T *const buf, const value_type& layer, const int x0, const int y0, const int z, const int c,
+                               const int w, const int h) {
+            if (layer._narrow) {
+                for (int y = 0; y < h; ++y) {
+                    _widen_span(buf + y*w, layer._narrow->data.data(x0, y0 + y, z, c), w, layer._narrow->format);
+                }
+                return;
+            }
+            if (layer._sparse) {
+                // Colors of the stored tiles, zero elsewhere
+                const Sparse_Image<T>& img = *layer._sparse;
+                const int tw = img.tile_width(), th = img.tile_height();
+                for (int ty = y0/th; ty*th < y0 + h; ++ty) {
+                    for (int tx = x0/tw; tx*tw < x0 + w; ++tx) {
+                        const CImg<T> *const t = img.tile(tx, ty);
+                        const int
+                            xa = std::max(x0, tx*tw), xb = std::min(x0 + w, (tx + 1)*tw),
+                            ya = std::max(y0, ty*th), yb = std::min(y0 + h, (ty + 1)*th);
+                        for (int y = ya; y < yb; ++y) {
+                            T *const ptrd = buf + (y - y0)*w + xa - x0;
+                            if (t) std::memcpy(ptrd, t->data(xa - tx*tw, y - ty*th, z, c), (xb - xa)*sizeof(T));
+                            else std::memset(ptrd, 0, (xb - xa)*sizeof(T));
+                        }
+                    }
+                }
+                return;
+            }
+            if (!layer._tiles) {
+                for (int y = 0; y < h; ++y) {
+                    std::memcpy(buf + y*w, layer._data->data(x0, y0 + y, z, c), w*sizeof(T));
+                }
+                return;
             }
-            CImg<T> img = _layers[0].data();
-            for (size_type i = 1; i < index; i++) {
-                if (_layers[i].visible()) {
-                    img = img.draw_image(_layers[i].data());
+            Tile_Store<T>& store = *layer._tiles;
+            const int tw = store.tile_width(), th = store.tile_height();
+            for (int ty = y0/th; ty*th < y0 + h; ++ty) {
+                for (int tx = x0/tw; tx*tw < x0 + w; ++tx) {
+                    const std::shared_ptr<const CImg<T> > t = store.tile(tx, ty, z, c);
+                    const int
+                        xa = std::max(x0, tx*tw), xb = std::min(x0 + w, (tx + 1)*tw),
+                        ya = std::max(y0, ty*th), yb = std::min(y0 + h, (ty + 1)*th);
+                    for (int y = ya; y < yb; ++y) {
+                        std::memcpy(buf + (y - y0)*w + xa - x0, t->data(xa - tx*tw, y - ty*th), (xb - xa)*sizeof(T));
+                    }
                 }
             }
-            return new Layer<T>(img);
         }
     };
 }
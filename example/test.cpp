@@ -18,10 +18,10 @@ int main() {
 
   //Test System
   cimg_extension::Layer_System<float,10> sys;
-  // cimg_extension::Layer<float> layer2 = *(sys.smooth_layer(layer1, 150, 200)); 
-  cimg_extension::Layer<float> layer3 = *(sys.blur_gradient_layer(layer1, 5));
+  // cimg_extension::Layer<float> layer2 = sys.smooth_layer(layer1, 150, 200); 
+  cimg_extension::Layer<float> layer3 = sys.blur_gradient_layer(layer1, 5);
   layer3.data().display();
-  cimg_extension::Layer<float> layer4 = *(sys.exposure_layer(layer1, 0.5));
+  cimg_extension::Layer<float> layer4 = sys.exposure_layer(layer1, 0.5);
   cimg_extension::Layer<float> layer5(img1);
   cimg_extension::Layer<float> layer6(img2);
 
@@ -50,8 +50,8 @@ int main() {
   //Test merge layer
   try {
   	sys.set_invisible(sys.data(1));
-  	cimg_extension::Layer<float> layer = *(sys.merge_layer());
-  	CImg<float> img = layer.data();
+  	cimg_extension::Layer<float> layer = sys.merge_layer();
+  	const CImg<float>& img = layer.data();
   	img.display();
   } catch(const char* msg) {
   	std::cerr << msg << std::endl;
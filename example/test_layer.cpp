@@ -0,0 +1,668 @@
+#include "Layer.h"
+#include <thread>
+#undef min
+#undef max
+
+using namespace cimg_library;
+using namespace cimg_extension;
+
+// Checks of the layer behaviors, each printed as ok or FAILED (the exit code counts the failures)
+static int nb_failures = 0;
+
+static void check(const bool condition, const char *const name) {
+  std::printf("%s: %s\n", condition ? "ok" : "FAILED", name);
+  if (!condition) ++nb_failures;
+}
+
+static double max_diff(const CImg<float>& a, const CImg<float>& b) {
+  if (!a.is_sameXYZC(b)) return 1e30;
+  return (a - b).abs().max();
+}
+
+// merge_layer() gives the same image whatever the tile size
+static void test_merge_tiles() {
+  CImg<float> base(64,48,1,3), middle(40,30,1,3), hidden(64,48,1,3);
+  base.rand(0,255);
+  middle.rand(0,255);
+  hidden.rand(0,255);
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(Layer<float>(middle));
+  sys.add_layer(Layer<float>(hidden,false));
+  const CImg<float> expected = CImg<float>(base).draw_image(middle);
+  sys.set_tile_size(7,5);
+  Layer<float> res = sys.merge_layer();
+  check(max_diff(res.data(),expected)==0,"merge_layer() with 7x5 tiles");
+  sys.set_tile_size(256,256);
+  res = sys.merge_layer();
+  check(max_diff(res.data(),expected)==0,"merge_layer() with tiles larger than the image");
+}
+
+// merge_layer() gives the same image whatever the thread count
+static void test_merge_threads() {
+  Layer_System<float,4> sys;
+  for (int i = 0; i<3; ++i) sys.add_layer(Layer<float>(CImg<float>(70,50,1,3).rand(0,255)));
+  sys.set_tile_size(16,16);
+  sys.set_thread_count(1);
+  Layer<float> serial = sys.merge_layer();
+  sys.set_thread_count(4);
+  Layer<float> parallel = sys.merge_layer();
+  check(max_diff(serial.data(),parallel.data())==0,"merge_layer() with 1 and 4 threads");
+}
+
+// draw_image() and merge_layer() blend with opacity as the scalar formula does
+static void test_opacity() {
+  const float nopacity = 0.3f, copacity = 1 - nopacity;
+  CImg<unsigned char> dst8(67,9,1,3), src8(67,9,1,3);
+  dst8.rand(0,255);
+  src8.rand(0,255);
+  const CImg<unsigned char> res8 = CImg<unsigned char>(dst8).draw_image(src8,nopacity);
+  bool is_exact = true;
+  cimg_foroff(res8,off) is_exact&=res8[off]==(unsigned char)(nopacity*src8[off] + dst8[off]*copacity);
+  check(is_exact,"draw_image() of 8-bit images with opacity");
+  CImg<float> dst(67,9,1,3), src(67,9,1,3);
+  dst.rand(0,255);
+  src.rand(0,255);
+  const CImg<float> res = CImg<float>(dst).draw_image(src,nopacity);
+  is_exact = true;
+  cimg_foroff(res,off) is_exact&=res[off]==nopacity*src[off] + dst[off]*copacity;
+  check(is_exact,"draw_image() of float images with opacity");
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(dst));
+  sys.add_layer(Layer<float>(src));
+  sys.data(1).set_opacity(nopacity);
+  Layer<float> merged = sys.merge_layer();
+  check(max_diff(merged.data(),res)==0,"merge_layer() of a layer with opacity");
+}
+
+// merge_layer() combines each pixel b of a layer with the pixel a below it by the blend mode
+static float blended(const Blend_Mode mode, const float a, const float b) {
+  switch (mode) {
+  case blend_multiply: return a*b/255;
+  case blend_screen: return a + b - a*b/255;
+  case blend_overlay: return 2*a<255 ? 2*a*b/255 : 255 - 2*(255 - a)*(255 - b)/255;
+  case blend_add: return std::min(a + b,255.f);
+  case blend_darken: return std::min(a,b);
+  case blend_lighten: return std::max(a,b);
+  default: return b;
+  }
+}
+
+static void test_blend_modes() {
+  const char *const names[] = { "normal", "multiply", "screen", "overlay", "add", "darken", "lighten" };
+  CImg<float> below(67,9,1,3), above(67,9,1,3);
+  below.rand(0,255);
+  above.rand(0,255);
+  for (int mode = blend_normal; mode<=blend_lighten; ++mode) {
+    Layer_System<float,4> sys;
+    sys.add_layer(Layer<float>(below));
+    sys.add_layer(Layer<float>(above));
+    sys.data(1).set_blend_mode((Blend_Mode)mode);
+    sys.data(1).set_opacity(0.6f);
+    CImg<float> expected(below);
+    cimg_foroff(expected,off) expected[off] = 0.6f*blended((Blend_Mode)mode,below[off],above[off]) + 0.4f*below[off];
+    Layer<float> merged = sys.merge_layer();
+    char name[64];
+    std::sprintf(name,"merge_layer() in %s mode",names[mode]);
+    check(max_diff(merged.data(),expected)<1e-3,name);
+  }
+}
+
+// Tiles covered by an opaque layer start from it, the others still blend every layer
+static void test_opaque_cover() {
+  CImg<float> base(64,48,1,3), middle(64,48,1,3), top(40,30,1,3);
+  base.rand(0,255);
+  middle.rand(0,255);
+  top.rand(0,255);
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(Layer<float>(middle));
+  sys.add_layer(Layer<float>(top));
+  sys.data(1).set_blend_mode(blend_multiply);
+  sys.set_tile_size(16,16);
+  CImg<float> expected(base);
+  cimg_foroff(expected,off) expected[off] = blended(blend_multiply,base[off],middle[off]);
+  expected.draw_image(top);
+  Layer<float> merged = sys.merge_layer();
+  check(max_diff(merged.data(),expected)<1e-3,"merge_layer() under a partly covering opaque layer");
+}
+
+// composite() recomposites only the dirty regions, and matches merge_layer()
+static void test_composite_dirty() {
+  Layer_System<float,4> sys;
+  for (int i = 0; i<3; ++i) sys.add_layer(Layer<float>(CImg<float>(64,48,1,3).rand(0,255)));
+  sys.data(2).set_opacity(0.5f);
+  sys.composite();
+  sys.draw_layer(1,10,12,CImg<float>(8,6,1,3,200));
+  const std::vector<Rect> updated = (sys.composite(),sys.updated_region());
+  check(updated.size()==1 && updated[0].x0==10 && updated[0].y0==12 && updated[0].x1==17 && updated[0].y1==17,
+        "composite() updates the drawn rectangle only");
+  Layer<float> merged = sys.merge_layer();
+  check(max_diff(sys.composite(),merged.data())==0,"composite() after draw_layer()");
+  sys.data(2).set_opacity(0.8f);
+  merged = sys.merge_layer();
+  check(max_diff(sys.composite(),merged.data())==0,"composite() after set_opacity()");
+  check(sys.dirty_region().empty(),"no dirty region after composite()");
+}
+
+// Repeated edits of one layer recomposite it over the cached partial composites
+static void test_cache() {
+  Layer_System<float,4> sys;
+  sys.set_cache_budget(1<<24);
+  for (int i = 0; i<4; ++i) sys.add_layer(Layer<float>(CImg<float>(64,48,1,3).rand(0,255)));
+  sys.data(1).set_blend_mode(blend_screen);
+  sys.data(2).set_opacity(0.5f);
+  sys.data(3).set_opacity(0.7f);
+  sys.composite();
+  for (int i = 0; i<3; ++i) {
+    sys.draw_layer(2,4 + 12*i,4,CImg<float>(8,8,1,3,50.f*i));
+    sys.composite();
+  }
+  check(sys.cache_size()>0,"partial composites built for the edited layer");
+  Layer<float> merged = sys.merge_layer();
+  check(max_diff(sys.composite(),merged.data())<1e-3,"composite() from the partial composites");
+}
+
+// Layers are drawn at their position, clipped to the bottom layer
+static void test_positions() {
+  CImg<float> base(64,48,1,3), sprite(20,16,1,3), corner(20,16,1,3);
+  base.rand(0,255);
+  sprite.rand(0,255);
+  corner.rand(0,255);
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(Layer<float>(sprite));
+  sys.add_layer(Layer<float>(corner));
+  sys.data(1).set_position(30,10);
+  sys.data(2).set_position(-5,-3);
+  sys.data(2).set_opacity(0.5f);
+  sys.composite();
+  const CImg<float> expected = CImg<float>(base).draw_image(30,10,sprite).draw_image(-5,-3,corner,0.5f);
+  Layer<float> merged = sys.merge_layer();
+  check(max_diff(merged.data(),expected)<1e-3,"merge_layer() of positioned layers");
+  sys.data(1).set_position(50,40);
+  check(max_diff(sys.composite(),CImg<float>(base).draw_image(50,40,sprite).draw_image(-5,-3,corner,0.5f))<1e-3,
+        "composite() after set_position()");
+}
+
+// The fused and tiled merge strategies give identical results
+static void test_merge_fused() {
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(CImg<float>(600,40,1,3).rand(0,255)));
+  sys.add_layer(Layer<float>(CImg<float>(300,30,1,3).rand(0,255)));
+  sys.add_layer(Layer<float>(CImg<float>(200,50,1,3).rand(0,255)));
+  sys.data(1).set_position(250,5);
+  sys.data(1).set_blend_mode(blend_overlay);
+  sys.data(2).set_position(-20,-10);
+  sys.data(2).set_opacity(0.4f);
+  Layer<float> tiled = sys.merge_layer();
+  sys.set_merge_strategy(merge_fused);
+  Layer<float> fused = sys.merge_layer();
+  check(max_diff(tiled.data(),fused.data())==0,"fused and tiled merge_layer()");
+}
+
+// Layers with alpha are stored premultiplied and blended over the layers below with their coverage
+static void test_alpha() {
+  CImg<float> base(64,48,1,3), colors(64,48,1,3), alpha(64,48,1,1,255);
+  base.rand(0,255);
+  colors.rand(0,255);
+  alpha.draw_rectangle(0,0,20,47,CImg<float>::vector(0).data()).draw_rectangle(21,0,40,47,CImg<float>::vector(100).data());
+  const Layer<float> layer(colors,alpha);
+  CImg<float> premultiplied(colors);
+  cimg_forXYZC(premultiplied,x,y,z,c) premultiplied(x,y,z,c)*=alpha(x,y)/255;
+  check(layer.has_alpha() && max_diff(layer.alpha(),alpha)==0,"alpha() of a layer with alpha");
+  check(max_diff(layer.data(),premultiplied)<1e-3,"data() of a layer with alpha is premultiplied");
+  for (int mode = blend_normal; mode<=blend_multiply; ++mode) {
+    Layer_System<float,4> sys;
+    sys.add_layer(Layer<float>(base));
+    sys.add_layer(layer);
+    sys.data(1).set_opacity(0.8f);
+    sys.data(1).set_blend_mode((Blend_Mode)mode);
+    CImg<float> expected(base);
+    cimg_forXYZC(expected,x,y,z,c) {
+      const float coverage = 0.8f*alpha(x,y)/255, a = base(x,y,z,c);
+      expected(x,y,z,c) = coverage*blended((Blend_Mode)mode,a,colors(x,y,z,c)) + (1 - coverage)*a;
+    }
+    Layer<float> merged = sys.merge_layer();
+    check(max_diff(merged.data(),expected)<1e-2,mode==blend_normal ? "merge_layer() of a layer with alpha" :
+          "merge_layer() of a layer with alpha in multiply mode");
+    sys.set_merge_strategy(merge_fused);
+    merged = sys.merge_layer();
+    check(max_diff(merged.data(),expected)<1e-2,"fused merge_layer() of a layer with alpha");
+  }
+  // 8-bit colors are premultiplied with rounding to nearest, whichever way the layer is built
+  const CImg<unsigned char> colors8(colors), alpha8(alpha);
+  CImg<float> rounded(colors8);
+  cimg_forXYZC(rounded,x,y,z,c) rounded(x,y,z,c) = cimg::round(rounded(x,y,z,c)*alpha8(x,y)/255);
+  const Layer<unsigned char> dense8(colors8,alpha8), sparse8 = Layer<unsigned char>::sparse(colors8,alpha8,16,16);
+  check(max_diff(dense8.data(),rounded)==0 && max_diff(sparse8.get_image(),rounded)==0,
+        "8-bit colors are premultiplied with rounding");
+  Layer<unsigned char> realpha(colors8,CImg<unsigned char>(64,48,1,1,255));
+  realpha.set_alpha(alpha8);
+  check(max_diff(realpha.data(),rounded)==0,"set_alpha() over an opaque alpha");
+}
+
+// Copies of a layer share its pixels until one of them is modified
+static void test_copy_on_write() {
+  const CImg<float> img = CImg<float>(64,48,1,3).rand(0,255);
+  const Layer<float> layer(img);
+  const unsigned long nb_copies = Layer<float>::copy_count();
+  Layer<float> copy(layer);
+  check(Layer<float>::copy_count()==nb_copies && &copy.data()==&layer.data(),"copies of a layer share their pixels");
+  copy.mutable_data().fill(0);
+  check(Layer<float>::copy_count()==nb_copies + 1,"mutable_data() copies shared pixels once");
+  copy.mutable_data().fill(1);
+  check(Layer<float>::copy_count()==nb_copies + 1,"mutable_data() does not copy unshared pixels");
+  check(max_diff(layer.data(),img)==0 && copy.data().max()==1,"mutable_data() leaves the other copies unchanged");
+}
+
+// Moves take the pixels of images and layers without copying them
+static void test_move() {
+  CImg<float> img = CImg<float>(64,48,1,3).rand(0,255);
+  const CImg<float> expected = img.get_exposure(0.5);
+  const float *const pixels = img.data();
+  const unsigned long nb_copies = Layer<float>::copy_count();
+  Layer<float> layer(std::move(img));
+  Layer<float> moved(std::move(layer));
+  moved.set_opacity(0.5f);
+  check(moved.data().data()==pixels,"moved images and layers keep their pixels");
+  Layer_System<float,4> sys;
+  sys.add_layer(std::move(moved));
+  Layer<float>& emplaced = sys.emplace_layer(32,24,1,3,7.f);
+  check(emplaced.data().width()==32 && emplaced.data().min()==7,"emplace_layer() constructs the image in place");
+  Layer<float> res = sys.exposure_layer(std::move(sys.data(0)),0.5);
+  check(res.opacity()==0.5f && max_diff(res.data(),expected)<1e-3,"exposure_layer() of a moved layer");
+  check(Layer<float>::copy_count()==nb_copies,"no pixels copied");
+}
+
+// Layers account their pixel storage, released by the last layer sharing it
+static void test_memory() {
+  const unsigned long long allocated = Layer<float>::allocated_bytes(), freed = Layer<float>::freed_bytes();
+  {
+    Layer_System<float,4> sys;
+    sys.emplace_layer(64,48,1,3,0.f);
+    sys.add_layer(sys.data(0));
+    sys.set_merge_strategy(merge_fused);
+    check(Layer<float>::allocated_bytes() - allocated==64*48*3*sizeof(float),"shared storage counted once");
+    const Layer<float> merged = sys.merge_layer();
+    check(Layer<float>::allocated_bytes() - allocated==2*64*48*3*sizeof(float),"merge_layer() storage counted");
+    check(sys.composite_size()==0,"no composite before composite()");
+    sys.composite();
+    check(sys.composite_size()>=64*48*3*sizeof(float),"composite_size() after composite()");
+  }
+  check(Layer<float>::freed_bytes() - freed==Layer<float>::allocated_bytes() - allocated,"all storage freed");
+}
+
+// A runtime-sized system grows as needed, and layers can be inserted, removed and reordered
+static void test_runtime_size() {
+  Layer_System<float> sys;
+  for (int i = 0; i<20; ++i) sys.emplace_layer(16,16,1,3,(float)i);
+  sys.insert_at(0,Layer<float>(CImg<float>(16,16,1,3,100)));
+  sys.remove_at(1);
+  check(sys.size()==20 && sys.data(0).data()(0)==100 && sys.data(1).data()(0)==1,"insert_at() and remove_at()");
+  sys.move(0,19);
+  check(sys.data(0).data()(0)==1 && sys.data(19).data()(0)==100 && sys.composite()(0)==100,"move()");
+  sys.swap(0,19);
+  check(sys.data(0).data()(0)==100 && sys.data(19).data()(0)==1 && sys.composite()(0)==1,"swap()");
+  check(sys.merge_layer().data()(0)==1,"merge_layer() of the reordered layers");
+}
+
+// Layer buffers freed with a pool budget are handed out again
+static void test_pixel_pool() {
+  Pixel_Pool<float>& pool = Pixel_Pool<float>::instance();
+  pool.set_budget(1<<24);
+  Layer_System<float,4> sys;
+  sys.emplace_layer(64,48,1,3,10.f);
+  sys.emplace_layer(32,24,1,3,20.f);
+  sys.set_merge_strategy(merge_fused);
+  const CImg<float> expected = CImg<float>(64,48,1,3,10).draw_image(CImg<float>(32,24,1,3,20));
+  check(max_diff(sys.merge_layer().data(),expected)==0,"merge_layer() from the pool");
+  const unsigned long hits = pool.hits();
+  check(pool.pooled_bytes()>=64*48*3*sizeof(float),"freed layer buffer kept in the pool");
+  check(max_diff(sys.merge_layer().data(),expected)==0 && pool.hits()==hits + 1,"pooled buffer reused");
+  pool.set_budget(0);
+  check(pool.pooled_bytes()==0,"no buffer kept without a budget");
+}
+
+// Mapped layers read their pixels from a file, and only write them back when writable
+static void test_mapped() {
+  const CImg<float> img = CImg<float>(64,48,1,3).rand(0,255);
+  img.save_cimg("test_layer_mapped.cimg");
+  {
+    Layer<float> layer = Layer<float>::map_cimg("test_layer_mapped.cimg");
+    check(max_diff(layer.data(),img)==0,"map_cimg() reads the file");
+    layer.mutable_data().fill(0);
+    Layer<float> writable = Layer<float>::map_cimg("test_layer_mapped.cimg",true);
+    check(max_diff(writable.data(),img)==0,"pixel changes of a read-only mapping stay in memory");
+    writable.mutable_data().fill(7);
+  }
+  check(max_diff(CImg<float>("test_layer_mapped.cimg"),CImg<float>(64,48,1,3,7))==0,
+        "pixel changes of a writable mapping are written to the file");
+  {
+    // Copying the pixels of a mapped layer makes it a regular layer
+    const Layer<float> mapped = Layer<float>::map_cimg("test_layer_mapped.cimg");
+    Layer<float> copy(mapped), alpha(mapped);
+    copy.mutable_data().fill(1);
+    check(mapped.storage_size()==0 && copy.storage_size()==img.size()*sizeof(float),
+          "mutable_data() on a shared mapped layer");
+    copy.set_storage(storage_half);
+    check(copy.storage()==storage_half,"set_storage() after mutable_data() on a mapped layer");
+    alpha.set_alpha(CImg<float>(64,48,1,1,255));
+    alpha.compress();
+    check(alpha.is_compressed(),"compress() after set_alpha() on a mapped layer");
+  }
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(img));
+  sys.emplace_layer(32,24,1,3,20.f);
+  sys.data(1).set_opacity(0.5f);
+  const Layer<float> merged = sys.merge_layer("test_layer_mapped.raw");
+  check(max_diff(merged.data(),sys.merge_layer().data())==0,"merge_layer() into a file");
+  check(max_diff(Layer<float>::map_raw("test_layer_mapped.raw",64,48,1,3).data(),merged.data())==0,
+        "map_raw() of a merged file");
+  std::remove("test_layer_mapped.cimg");
+  std::remove("test_layer_mapped.raw");
+}
+
+// Tiled layers merge, draw and filter like dense ones, with a tile cache smaller than the layer
+static void test_tiled() {
+  Tile_Cache<float>& cache = Tile_Cache<float>::instance();
+  const std::size_t budget = cache.budget();
+  cache.set_budget(4*16*16*sizeof(float));
+  const CImg<float> base = CImg<float>(100,70,1,3).rand(0,255), img = CImg<float>(90,60,1,3).rand(0,255);
+  const Layer<float> tiled = Layer<float>::tiled(img,0,16,16);
+  check(tiled.is_tiled() && max_diff(tiled.get_image(),img)==0,"get_image() of a tiled layer");
+  bool has_thrown = false;
+  try { tiled.data(); } catch (const char *const msg) { has_thrown = !std::strcmp(msg,"tiled layer"); }
+  check(has_thrown,"data() of a tiled layer throws");
+  Layer_System<float,4> sys, dense;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(tiled);
+  dense.add_layer(Layer<float>(base));
+  dense.add_layer(Layer<float>(img));
+  sys.data(1).set_opacity(0.6f);
+  sys.data(1).set_position(5,3);
+  dense.data(1).set_opacity(0.6f);
+  dense.data(1).set_position(5,3);
+  check(max_diff(sys.merge_layer().data(),dense.merge_layer().data())<1e-3,"merge_layer() of a tiled layer");
+  check(max_diff(sys.merge_layer_tiled(0,32,32).get_image(),dense.merge_layer().data())<1e-3,"merge_layer_tiled()");
+  sys.composite();
+  sys.draw_layer(1,20,10,CImg<float>(30,30,1,3,200));
+  dense.draw_layer(1,20,10,CImg<float>(30,30,1,3,200));
+  check(max_diff(sys.composite(),dense.composite())<1e-3,"composite() after draw_layer() on a tiled layer");
+  check(max_diff(sys.exposure_layer(tiled,0.5).get_image(),tiled.get_image().get_exposure(0.5))<1e-2,
+        "exposure_layer() of a tiled layer");
+  Tile_Store<float> store(0,90,60,1,3,16,16);
+  store.draw_image(0,0,0,0,img);
+  std::atomic<int> nb_wrong(0);
+  std::vector<std::thread> threads;
+  for (int k = 0; k<4; ++k) threads.emplace_back([&]() {
+      for (int n = 0; n<8; ++n) if (max_diff(store.get_crop(0,0,0,0,89,59,0,2),img)!=0) ++nb_wrong;
+    });
+  for (std::thread& thread : threads) thread.join();
+  check(!nb_wrong,"get_crop() of a tile store from several threads");
+  cache.set_budget(budget);
+}
+
+// Sparse layers store only their non-empty tiles, the others being transparent
+static void test_sparse() {
+  const CImg<float> base = CImg<float>(200,150,1,3).rand(0,255), color = CImg<float>::vector(255,128,64);
+  CImg<float> img(200,150,1,3,0);
+  img.draw_rectangle(64,32,127,95,color.data());
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(Layer<float>::sparse(img,16,16));
+  check(sys.data(1).is_sparse() && sys.data(1).sparse_image().nb_stored()==16,"sparse() stores the non-empty tiles");
+  check(max_diff(sys.data(1).get_image(),img)==0,"get_image() of a sparse layer");
+  bool has_thrown = false;
+  try { sys.data(1).data(); } catch (const char *const msg) { has_thrown = !std::strcmp(msg,"sparse layer"); }
+  check(has_thrown,"data() of a sparse layer throws");
+  CImg<float> expected = CImg<float>(base).draw_rectangle(64,32,127,95,color.data());
+  check(max_diff(sys.merge_layer().data(),expected)==0,"merge_layer() of a sparse layer");
+  sys.composite();
+  sys.draw_layer(1,5,5,CImg<float>(10,10,1,3,200));
+  expected.draw_rectangle(5,5,14,14,CImg<float>::vector(200,200,200).data());
+  check(max_diff(sys.composite(),expected)==0,"composite() after draw_layer() on a sparse layer");
+  check(sys.data(1).sparse_image().nb_stored()==17,"draw_layer() adds a tile");
+}
+
+// Compressed layers decompress when used, and the compression budget compresses hidden layers first
+static void test_compression() {
+  CImg<float> img(128,96,1,3);
+  cimg_forXYZC(img,x,y,z,c) img(x,y,z,c) = (float)((x/4 + y/8 + 40*c)%256);
+  Layer<float> layer(img);
+  layer.compress();
+  check(layer.is_compressed() && layer.compressed_size()<img.size()*sizeof(float),"compress() of a layer");
+  check(max_diff(layer.data(),img)==0 && !layer.is_compressed(),"data() of a compressed layer");
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(img));
+  sys.add_layer(Layer<float>(img.get_mirror('x')));
+  sys.add_layer(Layer<float>(img.get_crop(0,0,63,47)));
+  sys.data(2).set_opacity(0.5f);
+  sys.set_invisible(sys.data(1));
+  sys.set_compression_budget(2*img.size()*sizeof(float) + 1);
+  check(sys.data(1).is_compressed() && !sys.data(0).is_compressed(),"hidden layer compressed first");
+  const CImg<float> expected = CImg<float>(img).draw_image(img.get_crop(0,0,63,47),0.5f);
+  check(max_diff(sys.composite(),expected)==0 && max_diff(sys.merge_layer().data(),expected)==0,
+        "merge_layer() and composite() with a compression budget");
+  sys.set_visible(sys.data(1));
+  check(max_diff(sys.composite(),CImg<float>(img.get_mirror('x')).draw_image(img.get_crop(0,0,63,47),0.5f))==0,
+        "composite() of a compressed layer made visible");
+}
+
+// Float layers stored as 16-bit floats take half the memory and merge like native ones
+static void test_half_storage() {
+  const CImg<float> base = CImg<float>(64,48,1,3).rand(0,255).round(), img = CImg<float>(40,30,1,3).rand(0,255);
+  Layer<float> layer(img.get_round());
+  layer.set_storage(storage_half);
+  check(layer.storage()==storage_half && layer.storage_size()==img.size()*2,"storage_half halves the storage");
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(layer);
+  sys.data(1).set_opacity(0.5f);
+  sys.data(1).set_position(10,5);
+  const CImg<float> expected = CImg<float>(base).draw_image(10,5,img.get_round(),0.5f);
+  check(max_diff(sys.merge_layer().data(),expected)==0,"merge_layer() of a half layer");
+  const Layer<float> exposed = sys.exposure_layer(layer,0.5);
+  const CImg<float> exposure = img.get_round().exposure(0.5);
+  check(exposed.storage()==storage_half && max_diff(exposed.get_image(),exposure)<=exposure.max()/1024,
+        "exposure_layer() of a half layer");
+  layer.set_storage(storage_bfloat16);
+  check(layer.storage()==storage_bfloat16 && max_diff(layer.get_image(),img.get_round())==0,"storage_bfloat16");
+  Layer<float> narrow(img);
+  narrow.set_storage(storage_bfloat16);
+  check(max_diff(narrow.data(),img)<=1 && narrow.storage()==storage_native,"data() converts back to storage_native");
+}
+
+// 8 and 16-bit layers blend in fixed point, within one level of the exact result
+template<typename T>
+static bool test_fixed_blend(const Blend_Mode mode) {
+  const float white = (float)cimg::type<T>::max(), scale = white/255;
+  CImg<T> below(67,9,1,3), above(67,9,1,3);
+  below.rand(0,(T)white);
+  above.rand(0,(T)white);
+  Layer_System<T,4> sys;
+  sys.add_layer(Layer<T>(below));
+  sys.add_layer(Layer<T>(above));
+  sys.data(1).set_blend_mode(mode);
+  sys.data(1).set_opacity(0.6f);
+  const CImg<T> merged = sys.merge_layer().data();
+  bool is_close = true;
+  cimg_foroff(merged,off) {
+    const float a = below[off]/scale, expected = (0.6f*blended(mode,a,above[off]/scale) + 0.4f*a)*scale;
+    is_close&=cimg::abs(merged[off] - expected)<=1;
+  }
+  return is_close;
+}
+
+static void test_fixed_point() {
+  const char *const names[] = { "normal", "multiply", "screen", "overlay", "add", "darken", "lighten" };
+  for (int mode = blend_normal; mode<=blend_lighten; ++mode) {
+    char name[64];
+    std::sprintf(name,"8-bit merge_layer() in %s mode",names[mode]);
+    check(test_fixed_blend<unsigned char>((Blend_Mode)mode),name);
+    std::sprintf(name,"16-bit merge_layer() in %s mode",names[mode]);
+    check(test_fixed_blend<unsigned short>((Blend_Mode)mode),name);
+  }
+  const CImg<unsigned char> img = CImg<unsigned char>(64,48,1,3).rand(0,255);
+  const CImg<float> expected = CImg<float>(img).exposure(0.5).cut(0,255).round();
+  Layer_System<unsigned char,4> sys;
+  check(max_diff(sys.exposure_layer(Layer<unsigned char>(img),0.5).data(),expected)<=1,"8-bit exposure_layer()");
+  check(max_diff(img.get_exposure(0.5),CImg<float>(img).exposure(0.5))==0,"get_exposure() of an 8-bit image stays in float");
+  // The rows are rounded before the columns are blurred, and normalization stretches the blurred noise about 4 times.
+  check(max_diff(CImg<unsigned char>(img).blur_gradient(1),CImg<float>(img).blur_gradient(1).round())<=2,
+        "8-bit blur_gradient() in T");
+  check(max_diff(CImg<unsigned char>(img).smooth_iterate(1),CImg<float>(img).smooth_iterate(1).cut(0,255).round())<=1,
+        "8-bit smooth_iterate() in T");
+}
+
+// smooth_iterate() hands each iterate to its checkpoint, as smooth() lists them
+struct Keep_Iterate {
+  unsigned int index, nb_calls;
+  CImg<float> iterate;
+  void operator()(const unsigned int i, const CImg<float>& img) {
+    ++nb_calls;
+    if (i==index) iterate = img;
+  }
+};
+
+static void test_smooth_iterate() {
+  const CImg<float> img = CImg<float>(48,32,1,3).rand(0,255);
+  const CImgList<float> list = CImg<float>(img).smooth(5);
+  check(list.size()==6 && max_diff(list[0],img)==0,"smooth() lists the image and its iterates");
+  Keep_Iterate keep = { 3, 0, CImg<float>() };
+  const CImg<float> last = CImg<float>(img).smooth_iterate(5,std::ref(keep));
+  check(keep.nb_calls==5 && max_diff(keep.iterate,list[3])==0,"smooth_iterate() checkpoints");
+  check(max_diff(last,list[5])==0 && max_diff(img.get_smooth(3,5),list[3])==0,"smooth_iterate() and get_smooth()");
+}
+
+// Layer::get_smooth() continues from the last iterate it computed, until the layer changes
+static void test_layer_smooth() {
+  const CImg<float> img = CImg<float>(48,32,1,3).rand(0,255);
+  Layer<float> layer(img);
+  check(max_diff(layer.get_smooth(3,10),img.get_smooth(3,10))<1e-3 && layer.smooth_index()==3,"get_smooth() of a layer");
+  check(max_diff(layer.get_smooth(5,10),img.get_smooth(5,10))<1e-3 && layer.smooth_index()==5,
+        "get_smooth() resumed from the last iterate");
+  check(max_diff(layer.get_smooth(2,10),img.get_smooth(2,10))<1e-3,"get_smooth() of an earlier iterate");
+  layer.mutable_data().fill(100);
+  check(layer.smooth_index()==0 && max_diff(layer.get_smooth(4,10),CImg<float>(48,32,1,3,100))<1e-3,
+        "get_smooth() after the layer changed");
+  layer.clear_smooth();
+  check(layer.smooth_index()==0,"clear_smooth()");
+}
+
+// The vectorized curvature-flow velocity gives the same values as the scalar loop
+static void test_smooth_velocity() {
+  const CImg<float> rows = CImg<float>(67,3).rand(0,255);
+  CImg<float> fast(67), slow(67);
+  const float
+    fast_max = cimg::smooth_velocity(fast.data(),rows.data(0,0),rows.data(0,1),rows.data(0,2),67),
+    slow_max = cimg::smooth_velocity<float,float>(slow.data(),rows.data(0,0),rows.data(0,1),rows.data(0,2),67);
+#ifdef __FAST_MATH__
+  // -ffast-math lets the compiler reassociate the scalar loop
+  const float tolerance = 1e-4f*slow_max;
+#else
+  const float tolerance = 0;
+#endif
+  check(cimg::abs(fast_max - slow_max)<=tolerance && max_diff(fast,slow)<=tolerance,"smooth_velocity() of a float row");
+}
+
+// mark_dirty() on a layer other than the cached focus one drops the partial composites
+static void test_cache_mark_dirty() {
+  CImg<float> base(64,48,1,3,30), middle(64,48,1,3,60), top(64,48,1,3,90);
+  Layer_System<float,4> sys;
+  sys.set_cache_budget(1<<24);
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(Layer<float>(middle));
+  sys.add_layer(Layer<float>(top));
+  sys.data(1).set_opacity(0.5f);
+  sys.data(2).set_opacity(0.5f);
+  CImg<float>& pixels = sys.data(1).mutable_data();
+  sys.composite();
+  sys.draw_layer(2,4,4,CImg<float>(8,8,1,3,200));
+  sys.composite();
+  sys.draw_layer(2,20,4,CImg<float>(8,8,1,3,10));
+  sys.composite();
+  check(sys.cache_size()>0,"partial composites built for the top layer");
+  pixels.fill(240);
+  sys.mark_dirty(1);
+  check(max_diff(sys.composite(),sys.merge_layer().data())<1e-3,"composite() after mark_dirty() on another layer");
+}
+
+// draw_layer() on a layer with alpha makes the drawn pixels opaque
+static void test_draw_alpha() {
+  CImg<float> base(64,48,1,3,40), colors(64,48,1,3,100), alpha(64,48,1,1,255), sprite(16,12,1,3,200);
+  alpha.draw_rectangle(8,8,40,30,CImg<float>::vector(0).data());
+  Layer<float> layer(colors);
+  layer.set_alpha(alpha);
+  Layer_System<float,4> sys;
+  sys.add_layer(Layer<float>(base));
+  sys.add_layer(layer);
+  sys.composite();
+  sys.draw_layer(1,10,10,sprite);
+  const CImg<float> merged = sys.merge_layer().data();
+  check(max_diff(merged.get_crop(10,10,25,21),sprite)==0,"draw_layer() over transparent pixels");
+  check(max_diff(sys.composite(),merged)<1e-3,"composite() after draw_layer() on a layer with alpha");
+  sys.draw_layer(1,30,20,sprite,0.5f);
+  check(max_diff(sys.composite(),sys.merge_layer().data())<1e-3,"composite() after a translucent draw_layer()");
+  check(cimg::abs(sys.merge_layer().data()(35,25,0,0) - 120)<1e-3,"translucent draw_layer() over transparent pixels");
+}
+
+// The filters work on the unpremultiplied colors and keep the alpha plane
+static CImg<float> premultiplied(const CImg<float>& colors, const CImg<float>& alpha) {
+  CImg<float> res(colors);
+  cimg_forXYZC(res,x,y,z,c) res(x,y,z,c)*=alpha(x,y,z)/255;
+  return res;
+}
+
+static void test_filter_alpha() {
+  CImg<float> colors(64,48,1,3), alpha(64,48,1,1,255);
+  colors.rand(10,250);
+  alpha.draw_rectangle(0,0,31,47,CImg<float>::vector(128).data());
+  Layer<float> layer(colors);
+  layer.set_alpha(alpha);
+  Layer_System<float,4> sys;
+  const CImg<float> expected = premultiplied(colors.get_exposure(0.5),alpha);
+  const Layer<float> res = sys.exposure_layer(layer,0.5);
+  check(res.has_alpha() && max_diff(res.alpha(),alpha)==0,"exposure_layer() keeps alpha");
+  check(max_diff(res.data(),expected)<0.1,"exposure_layer() of unpremultiplied colors");
+  check(max_diff(sys.exposure_layer(Layer<float>(layer),0.5).data(),expected)<0.1,"exposure_layer() of a moved layer");
+  const Layer<float> sparse = sys.exposure_layer(Layer<float>::sparse(colors,alpha,16,16),0.5);
+  check(max_diff(sparse.get_image(),expected)<0.1,"exposure_layer() of a sparse layer");
+  const Layer<float> blurred = sys.blur_gradient_layer(layer,2);
+  check(blurred.has_alpha() && max_diff(blurred.data(),premultiplied(colors.get_blur_gradient(2),alpha))<0.1,
+        "blur_gradient_layer() keeps alpha");
+  const Layer<float> smoothed = sys.smooth_layer(layer,3,10);
+  check(smoothed.has_alpha() && max_diff(smoothed.data(),premultiplied(colors.get_smooth(3,10),alpha))<0.1,
+        "smooth_layer() keeps alpha");
+}
+
+int main() {
+  test_merge_tiles();
+  test_merge_threads();
+  test_opacity();
+  test_blend_modes();
+  test_opaque_cover();
+  test_composite_dirty();
+  test_cache();
+  test_positions();
+  test_merge_fused();
+  test_alpha();
+  test_copy_on_write();
+  test_move();
+  test_memory();
+  test_runtime_size();
+  test_pixel_pool();
+  test_mapped();
+  test_tiled();
+  test_sparse();
+  test_compression();
+  test_half_storage();
+  test_fixed_point();
+  test_smooth_iterate();
+  test_layer_smooth();
+  test_smooth_velocity();
+  test_cache_mark_dirty();
+  test_draw_alpha();
+  test_filter_alpha();
+  return nb_failures;
+}